@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "echttp.h"
 #include "echttp_cors.h"
@@ -46,8 +47,12 @@
 #include "housedepositor.h"
 
 #include "housetuya.h"
+#include "housetuya_json.h"
 #include "housetuya_model.h"
+#include "housetuya_messages.h"
+#include "housetuya_hash.h"
 #include "housetuya_device.h"
+#include "housetuya_events.h"
 
 static int use_houseportal = 0;
 
@@ -57,47 +62,259 @@ int housetuya_isdebug (void) {
     return echttp_isdebug();
 }
 
-static const char *housetuya_status (const char *method, const char *uri,
-                                    const char *data, int length) {
-    static char buffer[65537];
-    ParserToken token[1024];
-    char pool[65537];
-    char host[256];
+// The status of each device is rendered again only when it changed, and
+// the whole document is not rendered at all if the client already has
+// the current version (ETag / If-None-Match).
+//
+struct StatusFragment {
+    long long updated;
+    TuyaJson json;
+};
+static struct StatusFragment *StatusFragments = 0;
+static int StatusFragmentsCount = 0;
+static TuyaJson StatusDocument;
+static time_t StatusEpoch = 0; // Keep the ETag unique across restarts.
+
+const char *housetuya_host (void) {
+    static char host[256] = {0};
+    if (!host[0]) gethostname (host, sizeof(host));
+    return host;
+}
+
+static void housetuya_status_point (TuyaJson *json, int i) {
+
+    time_t pulsed = housetuya_device_deadline(i);
+    const char *status = housetuya_device_failure(i);
+    if (!status) status = housetuya_device_get(i)?"on":"off";
+
+    housetuya_json_object (json, housetuya_device_name(i));
+    housetuya_json_string (json, "state", status);
+    housetuya_json_string (json, "command",
+                           housetuya_device_commanded(i)?"on":"off");
+    if (pulsed)
+        housetuya_json_integer (json, "pulse", (long long)pulsed);
+    housetuya_json_integer (json, "interval", housetuya_device_interval(i));
+    int collapsed = housetuya_device_collapsed(i);
+    if (collapsed)
+        housetuya_json_integer (json, "collapsed", collapsed);
+
+    int j;
+    int dps = 0;
+    const char *key;
+    TuyaDataPoint value;
+    for (j = 0; (key = housetuya_device_dps (i, j, &value, 0)); ++j) {
+        if (!dps) {
+            housetuya_json_object (json, "dps");
+            dps = 1;
+        }
+        switch (value.type) {
+        case TUYA_DPS_BOOL:
+            housetuya_json_bool (json, key, value.value.bool);
+            break;
+        case TUYA_DPS_INTEGER:
+            housetuya_json_integer (json, key, value.value.integer);
+            break;
+        case TUYA_DPS_REAL:
+            housetuya_json_real (json, key, value.value.real);
+            break;
+        case TUYA_DPS_STRING:
+            housetuya_json_string (json, key, value.value.string);
+            break;
+        }
+    }
+    if (dps) housetuya_json_end (json);
+    housetuya_json_string (json, "gear", "light");
+    housetuya_json_end (json);
+}
+
+static const char *housetuya_status_render (int conditional) {
+
+    static char etag[64];
+    const char *proxy = houseportal_server();
     int count = housetuya_device_count();
     int i;
 
-    gethostname (host, sizeof(host));
+    if (!StatusEpoch) StatusEpoch = time(0);
+    snprintf (etag, sizeof(etag), "\"%lx-%llx-%x\"",
+              (long)StatusEpoch, housetuya_device_generation(),
+              housetuya_hash (proxy ? proxy : ""));
+    echttp_attribute_set ("ETag", etag);
+
+    if (conditional) {
+        const char *match = echttp_attribute_get ("If-None-Match");
+        if (match && (!strcmp (match, etag))) {
+            echttp_error (304, "Not Modified");
+            return "";
+        }
+    }
 
-    ParserContext context = echttp_json_start (token, 1024, pool, 65537);
+    if (count > StatusFragmentsCount) {
+        struct StatusFragment *fragments =
+            realloc (StatusFragments, count * sizeof(struct StatusFragment));
+        if (!fragments) {
+            echttp_error (500, "no more memory");
+            return "";
+        }
+        memset (fragments + StatusFragmentsCount, 0,
+                (count - StatusFragmentsCount) * sizeof(struct StatusFragment));
+        StatusFragments = fragments;
+        StatusFragmentsCount = count;
+    }
 
-    int root = echttp_json_add_object (context, 0, 0);
-    echttp_json_add_string (context, root, "host", host);
-    echttp_json_add_string (context, root, "proxy", houseportal_server());
-    echttp_json_add_integer (context, root, "timestamp", (long)time(0));
-    int top = echttp_json_add_object (context, root, "control");
-    int container = echttp_json_add_object (context, top, "status");
+    TuyaJson *json = &StatusDocument;
+    housetuya_json_reset (json);
+    housetuya_json_object (json, 0);
+    housetuya_json_string (json, "host", housetuya_host());
+    housetuya_json_string (json, "proxy", proxy);
+    housetuya_json_integer (json, "timestamp", (long long)time(0));
+    housetuya_json_integer (json, "latest", housetuya_device_latest());
+    if (housetuya_events_port())
+        housetuya_json_integer (json, "eventport", housetuya_events_port());
+    housetuya_json_object (json, "control");
+    housetuya_json_object (json, "status");
 
     for (i = 0; i < count; ++i) {
-        time_t pulsed = housetuya_device_deadline(i);
-        const char *name = housetuya_device_name(i);
-        const char *status = housetuya_device_failure(i);
-        if (!status) status = housetuya_device_get(i)?"on":"off";
-        const char *commanded = housetuya_device_commanded(i)?"on":"off";
-
-        int point = echttp_json_add_object (context, container, name);
-        echttp_json_add_string (context, point, "state", status);
-        echttp_json_add_string (context, point, "command", commanded);
-        if (pulsed)
-            echttp_json_add_integer (context, point, "pulse", (int)pulsed);
-        echttp_json_add_string (context, point, "gear", "light");
+        struct StatusFragment *fragment = StatusFragments + i;
+        long long updated = housetuya_device_updated(i);
+        if ((fragment->updated != updated) ||
+            (housetuya_json_length (&(fragment->json)) <= 0)) {
+            housetuya_json_reset (&(fragment->json));
+            housetuya_status_point (&(fragment->json), i);
+            fragment->updated = updated;
+        }
+        const char *text = housetuya_json_text (&(fragment->json));
+        if (text)
+            housetuya_json_fragment
+                (json, text, housetuya_json_length (&(fragment->json)));
     }
-    const char *error = echttp_json_export (context, buffer, 65537);
-    if (error) {
-        echttp_error (500, error);
+    housetuya_json_end (json);
+    housetuya_json_end (json);
+    housetuya_json_end (json);
+
+    const char *text = housetuya_json_text (json);
+    if (!text) {
+        echttp_error (500, "no more memory");
         return "";
     }
     echttp_content_type_json ();
-    return buffer;
+    return text;
+}
+
+static const char *housetuya_status (const char *method, const char *uri,
+                                    const char *data, int length) {
+    return housetuya_status_render (1);
+}
+
+// Return the device state changes that occurred after the change
+// identified by the "since" parameter. The "latest" item is the value
+// to use as "since" in the next request. The "reset" item indicates
+// that some changes were lost: the client should get the full status.
+//
+// This request returns immediately: a client that wants to wait for
+// the next change uses the long poll port instead (see "eventport" in
+// the status).
+//
+static const char *housetuya_events (const char *method, const char *uri,
+                                     const char *data, int length) {
+    const char *sincep = echttp_parameter_get("since");
+    const char *text = housetuya_events_render (sincep ? atoll(sincep) : 0);
+    if (!text) {
+        echttp_error (500, "no more memory");
+        return "";
+    }
+    echttp_content_type_json ();
+    return text;
+}
+
+// Decode a list of data points, formatted as "id=value,id=value..."
+// The value is a boolean (true or false), an integer, a real, or else
+// a string.
+// The decoded strings point to the text buffer, which is modified.
+//
+static int housetuya_set_decode (char *text, TuyaDataPoint *dps, int size) {
+
+    int count = 0;
+
+    while (*text) {
+        if (count >= size) return -1;
+        char *item = text;
+        char *next = strchr (text, ',');
+        if (next) {
+            *next = 0;
+            text = next + 1;
+        } else {
+            text += strlen(text);
+        }
+        char *value = strchr (item, '=');
+        if ((!value) || (value == item)) return -1;
+        *(value++) = 0;
+
+        char *end;
+        dps[count].id = (int) strtol (item, &end, 10);
+        if ((*end != 0) || (dps[count].id <= 0)) return -1;
+
+        if (!strcmp (value, "true")) {
+            dps[count].type = TUYA_DPS_BOOL;
+            dps[count].value.bool = 1;
+        } else if (!strcmp (value, "false")) {
+            dps[count].type = TUYA_DPS_BOOL;
+            dps[count].value.bool = 0;
+        } else {
+            long integer = strtol (value, &end, 10);
+            if ((*value != 0) && (*end == 0)) {
+                dps[count].type = TUYA_DPS_INTEGER;
+                dps[count].value.integer = (int)integer;
+            } else {
+                double real = strtod (value, &end);
+                if ((*value != 0) && (*end == 0) && isfinite (real)) {
+                    dps[count].type = TUYA_DPS_REAL;
+                    dps[count].value.real = real;
+                } else {
+                    dps[count].type = TUYA_DPS_STRING;
+                    dps[count].value.string = value;
+                }
+            }
+        }
+        count += 1;
+    }
+    return count;
+}
+
+static const char *housetuya_set_dps (const char *method, const char *uri,
+                                      const char *data, int length,
+                                      const char *point, const char *dpsp) {
+
+    TuyaDataPoint dps[16];
+    char text[1024];
+    int i;
+
+    if (strlen(dpsp) >= sizeof(text)) {
+        echttp_error (400, "data points list too long");
+        return "";
+    }
+    strcpy (text, dpsp);
+    int count = housetuya_set_decode (text, dps, 16);
+    if (count <= 0) {
+        echttp_error (400, "invalid data points");
+        return "";
+    }
+    if (strcmp (point, "all") == 0) {
+        int devices = housetuya_device_count();
+        if (devices <= 0) {
+            echttp_error (404, "invalid point name");
+            return "";
+        }
+        for (i = 0; i < devices; ++i) housetuya_device_set_dps (i, dps, count);
+    } else {
+        i = housetuya_device_search (point);
+        if (i < 0) {
+            echttp_error (404, "invalid point name");
+            return "";
+        }
+        for (; i >= 0; i = housetuya_device_search_next (point, i))
+            housetuya_device_set_dps (i, dps, count);
+    }
+    return housetuya_status_render (0);
 }
 
 static const char *housetuya_set (const char *method, const char *uri,
@@ -106,16 +323,23 @@ static const char *housetuya_set (const char *method, const char *uri,
     const char *point = echttp_parameter_get("point");
     const char *statep = echttp_parameter_get("state");
     const char *pulsep = echttp_parameter_get("pulse");
+    const char *dpsp = echttp_parameter_get("dps");
     int state;
     int pulse;
     int i;
     int count = housetuya_device_count();
-    int found = 0;
 
     if (!point) {
         echttp_error (404, "missing point name");
         return "";
     }
+    if (dpsp) {
+        if (statep) {
+            echttp_error (400, "state and dps are mutually exclusive");
+            return "";
+        }
+        return housetuya_set_dps (method, uri, data, length, point, dpsp);
+    }
     if (!statep) {
         echttp_error (400, "missing state value");
         return "";
@@ -135,38 +359,46 @@ static const char *housetuya_set (const char *method, const char *uri,
         return "";
     }
 
-    for (i = 0; i < count; ++i) {
-       if ((strcmp (point, "all") == 0) ||
-           (strcmp (point, housetuya_device_name(i)) == 0)) {
-           found = 1;
-           housetuya_device_set (i, state, pulse);
-       }
-    }
-
-    if (! found) {
-        echttp_error (404, "invalid point name");
-        return "";
+    if (strcmp (point, "all") == 0) {
+        if (count <= 0) {
+            echttp_error (404, "invalid point name");
+            return "";
+        }
+        for (i = 0; i < count; ++i) housetuya_device_set (i, state, pulse);
+    } else {
+        i = housetuya_device_search (point);
+        if (i < 0) {
+            echttp_error (404, "invalid point name");
+            return "";
+        }
+        for (; i >= 0; i = housetuya_device_search_next (point, i))
+            housetuya_device_set (i, state, pulse);
     }
-    return housetuya_status (method, uri, data, length);
+    return housetuya_status_render (0);
 }
 
+// The configuration is written in a single pass, into a buffer that is
+// kept for the next export.
+//
 static const char *housetuya_export (void) {
 
-    static char buffer[65537];
-    static char pool[65537];
-    static ParserToken token[1024];
-    ParserContext context = echttp_json_start (token, 1024, pool, sizeof(pool));
-    int root = echttp_json_add_object (context, 0, 0);
-    int top  = echttp_json_add_object (context, root, "tuya");
-    housetuya_device_live_config (context, top);
-    housetuya_model_live_config (context, top);
-    const char *error = echttp_json_export (context, buffer, sizeof(buffer));
-    if (error) {
+    static TuyaJson json;
+
+    housetuya_json_reset (&json);
+    housetuya_json_object (&json, 0);
+    housetuya_json_object (&json, "tuya");
+    housetuya_device_live_config (&json);
+    housetuya_model_live_config (&json);
+    housetuya_json_end (&json);
+    housetuya_json_end (&json);
+
+    const char *text = housetuya_json_text (&json);
+    if (!text) {
         houselog_trace (HOUSE_FAILURE, "CONFIG",
-                        "Cannot export configuration: %s\n", error);
+                        "Cannot export configuration: no more memory\n");
         return 0;
     }
-    return buffer;
+    return text;
 }
 
 static void housetuya_refresh (void) {
@@ -180,6 +412,48 @@ static void housetuya_save_to_depot (const char *data, int length) {
     housedepositor_put ("config", houseconfig_name(), data, length);
 }
 
+// Changes detected by the service itself (e.g. a new device address) are
+// not saved immediately: a burst of changes (DHCP renumbering, recovery
+// from a power outage) is saved once things settle down, or after a
+// maximum delay. Nothing is written if the configuration did not actually
+// change since it was last saved.
+//
+#define TUYA_SAVE_DEBOUNCE  10 // Seconds without change before saving.
+#define TUYA_SAVE_MAXDELAY  60 // Maximum delay after the first change.
+
+static time_t SaveFirstChange = 0;
+static time_t SaveLastChange = 0;
+static char *SavedConfig = 0;
+
+static void housetuya_saved (const char *text) {
+    if (SavedConfig) free (SavedConfig);
+    SavedConfig = text ? strdup (text) : 0;
+}
+
+static void housetuya_persist (time_t now) {
+
+    // Both calls are needed, since they also reset the change flags.
+    if (housetuya_device_changed() | housetuya_model_changed()) {
+        if (!SaveFirstChange) SaveFirstChange = now;
+        SaveLastChange = now;
+    }
+    if (!SaveFirstChange) return;
+    if ((now < SaveLastChange + TUYA_SAVE_DEBOUNCE) &&
+        (now < SaveFirstChange + TUYA_SAVE_MAXDELAY)) return;
+    SaveFirstChange = SaveLastChange = 0;
+
+    const char *buffer = housetuya_export();
+    if (!buffer) return;
+    if (SavedConfig && (!strcmp (SavedConfig, buffer))) {
+        if (echttp_isdebug()) fprintf (stderr, "Configuration unchanged\n");
+        return;
+    }
+    houseconfig_update(buffer);
+    housetuya_save_to_depot (buffer, strlen(buffer));
+    housetuya_saved (buffer);
+    if (echttp_isdebug()) fprintf (stderr, "Configuration saved\n");
+}
+
 static const char *housetuya_config (const char *method, const char *uri,
                                   const char *data, int length) {
 
@@ -197,6 +471,7 @@ static const char *housetuya_config (const char *method, const char *uri,
         } else {
             housetuya_refresh();
             housetuya_save_to_depot (data, length);
+            housetuya_saved (0); // Not in the exported format.
         }
     } else {
         echttp_error (400, "invalid method");
@@ -220,12 +495,8 @@ static void housetuya_background (int fd, int mode) {
         }
     }
     housetuya_device_periodic(now);
-    if (housetuya_device_changed() || housetuya_model_changed()) {
-        const char *buffer = housetuya_export();
-        houseconfig_update(buffer);
-        housetuya_save_to_depot (buffer, strlen(buffer));
-        if (echttp_isdebug()) fprintf (stderr, "Configuration saved\n");
-    }
+    housetuya_events_periodic(now);
+    housetuya_persist (now);
     housediscover (now);
     houselog_background (now);
     housedepositor_periodic (now);
@@ -236,6 +507,7 @@ static void housetuya_config_listener (const char *name, time_t timestamp,
     houselog_event ("CONFIG", houseconfig_name(), "LOAD", "FROM DEPOT %s", name);
     if (!houseconfig_update (data)) {
         housetuya_refresh();
+        housetuya_saved (0);
         WasLoadedFromDepot = 1;
     }
 }
@@ -280,6 +552,8 @@ int main (int argc, const char **argv) {
             (HOUSE_FAILURE, "PLUG", "Cannot initialize: %s\n", error);
         exit(1);
     }
+    housetuya_events_initialize (argc, argv);
+    housetuya_saved (housetuya_export()); // As loaded.
     housedepositor_subscribe ("config", houseconfig_name(), housetuya_config_listener);
 
     echttp_cors_allow_method("GET");
@@ -287,6 +561,7 @@ int main (int argc, const char **argv) {
 
     echttp_route_uri ("/tuya/status", housetuya_status);
     echttp_route_uri ("/tuya/set",    housetuya_set);
+    echttp_route_uri ("/tuya/events", housetuya_events);
 
     echttp_route_uri ("/tuya/config", housetuya_config);
 
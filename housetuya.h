@@ -22,3 +22,4 @@
  */
 
 int housetuya_isdebug (void);
+const char *housetuya_host (void);
@@ -0,0 +1,161 @@
+/* HouseTuya - A simple web service for control of Tuya Devices
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housetuya_broadcast.c - Decode the Tuya discovery broadcasts.
+ *
+ * A discovery broadcast is a small, flat, JSON object that looks like:
+ *
+ *    {"ip":"192.168.1.xxx","gwId":"<ID>","active":2,"ablilty":0,
+ *     "encrypt":true,"productKey":"<KEY>","version":"3.3"}
+ *
+ * Only the gwId, productKey, encrypt and version items are used.
+ *
+ * SYNOPSYS:
+ *
+ * int housetuya_broadcast_scan (char *input, TuyaBroadcast *items);
+ *
+ *    Decode a broadcast without the generic JSON parser, taking advantage
+ *    of its fixed schema: a flat object with simple values. Return 0 if
+ *    the broadcast does not fit this schema (escaped characters in keys
+ *    or values, nested objects, missing separators, missing items..): the
+ *    input is then left unchanged, and housetuya_broadcast_parse() must
+ *    be used instead. On success the string values are terminated in
+ *    place and items point to them.
+ *
+ * const char *housetuya_broadcast_parse (char *input, TuyaBroadcast *items);
+ *
+ *    Decode a broadcast using the generic JSON parser. Return 0 on
+ *    success, or else an error message. The input is modified, and the
+ *    items point to strings inside the input.
+ */
+
+#include <string.h>
+
+#include "echttp_json.h"
+
+#include "housetuya_broadcast.h"
+
+// Return the position of the closing quote, or 0 if the string contains
+// an escaped character, which the scanner does not decode.
+//
+static const char *housetuya_broadcast_string (const char *s) {
+    s += strcspn (s, "\"\\");
+    return (*s == '"') ? s : 0;
+}
+
+static const char *housetuya_broadcast_space (const char *s) {
+    while ((*s == ' ') || (*s == '\t') || (*s == '\n') || (*s == '\r')) s += 1;
+    return s;
+}
+
+int housetuya_broadcast_scan (char *input, TuyaBroadcast *items) {
+
+    char *end[3] = {0, 0, 0};
+    const char *s = housetuya_broadcast_space (input);
+
+    items->id = items->product = items->version = 0;
+    items->encrypt = 0;
+
+    if (*s != '{') return 0;
+    s = housetuya_broadcast_space (s + 1);
+
+    while (*s == '"') {
+        const char *key = s + 1;
+        s = housetuya_broadcast_string (key);
+        if (!s) return 0;
+        int keylength = s - key;
+        s = housetuya_broadcast_space (s + 1);
+        if (*s != ':') return 0;
+        s = housetuya_broadcast_space (s + 1);
+
+        if (*s == '"') {
+            const char *value = s + 1;
+            s = housetuya_broadcast_string (value);
+            if (!s) return 0;
+            int slot = -1;
+            if ((keylength == 4) && (!memcmp (key, "gwId", 4))) {
+                items->id = value;
+                slot = 0;
+            } else if ((keylength == 10) && (!memcmp (key, "productKey", 10))) {
+                items->product = value;
+                slot = 1;
+            } else if ((keylength == 7) && (!memcmp (key, "version", 7))) {
+                items->version = value;
+                slot = 2;
+            }
+            if (slot >= 0) end[slot] = (char *)s;
+            s += 1;
+        } else if ((s[0] == 't') && (s[1] == 'r') && (s[2] == 'u') && (s[3] == 'e')) {
+            if ((keylength == 7) && (!memcmp (key, "encrypt", 7)))
+                items->encrypt = 1;
+            s += 4;
+        } else if ((s[0] == 'f') && (s[1] == 'a') && (s[2] == 'l') && (s[3] == 's') && (s[4] == 'e')) {
+            if ((keylength == 7) && (!memcmp (key, "encrypt", 7)))
+                items->encrypt = 0;
+            s += 5;
+        } else if ((*s == '-') || ((*s >= '0') && (*s <= '9'))) {
+            s += 1;
+            while (((*s >= '0') && (*s <= '9')) || (*s == '.')) s += 1;
+        } else {
+            return 0; // Object, array, null or invalid.
+        }
+        s = housetuya_broadcast_space (s);
+        if (*s == ',') {
+            s = housetuya_broadcast_space (s + 1);
+            if (*s != '"') return 0;
+        } else if (*s != '}') {
+            return 0; // Each value must be followed by a separator.
+        }
+    }
+    if (*s != '}') return 0;
+    if ((!end[0]) || (!end[1]) || (!end[2])) return 0;
+
+    *(end[0]) = *(end[1]) = *(end[2]) = 0;
+    return 1;
+}
+
+const char *housetuya_broadcast_parse (char *input, TuyaBroadcast *items) {
+
+    ParserToken json[16];
+    int jsoncount = 16;
+
+    const char *error = echttp_json_parse (input, json, &jsoncount);
+    if (error) return error;
+
+    int id = echttp_json_search (json, ".gwId");
+    if ((id < 0) || (json[id].type != PARSER_STRING)) return "no gwId";
+    items->id = json[id].value.string;
+
+    int product = echttp_json_search (json, ".productKey");
+    if ((product < 0) || (json[product].type != PARSER_STRING))
+        return "no productKey";
+    items->product = json[product].value.string;
+
+    items->encrypt = 0;
+    int encrypt = echttp_json_search (json, ".encrypt");
+    if ((encrypt >= 0) && (json[encrypt].type == PARSER_BOOL))
+        items->encrypt = json[encrypt].value.bool;
+
+    int version = echttp_json_search (json, ".version");
+    if ((version < 0) || (json[version].type != PARSER_STRING))
+        return "no version";
+    items->version = json[version].value.string;
+    return 0;
+}
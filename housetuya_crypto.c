@@ -24,14 +24,57 @@
  *
  * const char *housetuya_discoverykey (void);
  *
- *    Return the hardcoded Tuya discovery message key.
+ *    Return the hardcoded Tuya discovery message key. This is a binary
+ *    16 bytes MD5 digest, not a string: it may contain null bytes.
  *
- * int housetuya_encrypt (const unsigned char *key,
- *                        char *encrypted, char *clear, int length);
- * int housetuya_decrypt (const unsigned char *key,
+ * struct TuyaCipher *housetuya_discoverycipher (void);
+ *
+ *    Return the cipher context for the discovery key. This context is
+ *    shared by all discovery messages, and its decryption key schedule is
+ *    expanded on the first call, typically when the UDP sockets are opened.
+ *
+ * struct TuyaCipher *housetuya_cipher_new (const unsigned char *key);
+ * void housetuya_cipher_free (struct TuyaCipher *cipher);
+ *
+ *    Create, or release, a cipher context for the specified 16 bytes key.
+ *    A cipher context keeps the OpenSSL contexts with the expanded key,
+ *    so that these are not rebuilt for each message: each context is
+ *    created on first use and then only reset between messages.
+ *
+ * int housetuya_encrypt (struct TuyaCipher *cipher,
+ *                        char *encrypted, const char *clear, int length);
+ * int housetuya_decrypt (struct TuyaCipher *cipher,
  *                        const char *encrypted, char *clear, int length);
  *
- *    Encrypt and decrypt a Tuya message.
+ *    Encrypt and decrypt a Tuya message using AES-128 ECB with PKCS#7
+ *    padding. Return the length of the result, or 0 on error.
+ *
+ * int housetuya_encrypt_gcm (struct TuyaCipher *cipher,
+ *                            const unsigned char *iv,
+ *                            const char *aad, int aadlength,
+ *                            char *encrypted, const char *clear, int length,
+ *                            unsigned char *tag);
+ * int housetuya_decrypt_gcm (struct TuyaCipher *cipher,
+ *                            const unsigned char *iv,
+ *                            const char *aad, int aadlength,
+ *                            const char *encrypted, char *clear, int length,
+ *                            const unsigned char *tag);
+ *
+ *    Encrypt and decrypt a protocol 3.5 message using AES-GCM with the
+ *    provided 12 bytes IV. The additional authenticated data (aad) is
+ *    optional. The tag is 16 bytes. GCM does not use padding: the
+ *    encrypted data has the same length as the clear data. Return the
+ *    length of the result, or 0 on error (including an invalid tag).
+ *
+ * void housetuya_random (unsigned char *buffer, int length);
+ *
+ *    Fill the buffer with random bytes (used for session nonces).
+ *
+ * void housetuya_hmac (const unsigned char *key,
+ *                      const char *data, int length, unsigned char *digest);
+ *
+ *    Compute the HMAC-SHA256 signature of data (32 bytes) using the
+ *    provided 16 bytes key. This is used by protocol 3.4.
  */
 
 #include <time.h>
@@ -42,12 +85,20 @@
 #include <errno.h>
 
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 #include "housetuya.h"
 #include "housetuya_crypto.h"
 
 #define DEBUG if (housetuya_isdebug()) printf
 
+struct TuyaCipher {
+    unsigned char key[16];
+    EVP_CIPHER_CTX *ecb[2]; // Encrypt, decrypt.
+    EVP_CIPHER_CTX *gcm[2]; // Encrypt, decrypt.
+};
+
 static char TuyaDiscoveryPassword[] = "yGAdlopoPVldABfn";
 static unsigned char TuyaDiscoveryKey[EVP_MAX_MD_SIZE] = {0};
 
@@ -74,16 +125,81 @@ const char *housetuya_discoverykey (void) {
     return TuyaDiscoveryKey;
 }
 
-int housetuya_encrypt (const unsigned char *key,
-                       char *encrypted, char *clear, int length) {
-    int cursor, crypted_length;
+struct TuyaCipher *housetuya_cipher_new (const unsigned char *key) {
+    struct TuyaCipher *cipher = calloc (1, sizeof(struct TuyaCipher));
+    if (cipher) memcpy (cipher->key, key, sizeof(cipher->key));
+    return cipher;
+}
+
+void housetuya_cipher_free (struct TuyaCipher *cipher) {
+    int i;
+    if (!cipher) return;
+    for (i = 0; i < 2; ++i) {
+        if (cipher->ecb[i]) EVP_CIPHER_CTX_free (cipher->ecb[i]);
+        if (cipher->gcm[i]) EVP_CIPHER_CTX_free (cipher->gcm[i]);
+    }
+    free (cipher);
+}
+
+// Return the context for the specified algorithm and direction (0: encrypt,
+// 1: decrypt). The context is created, and the key expanded, on first use.
+//
+static EVP_CIPHER_CTX *housetuya_cipher_context (EVP_CIPHER_CTX **cache,
+                                                 const EVP_CIPHER *type,
+                                                 const unsigned char *key,
+                                                 int decrypt) {
+    if (cache[decrypt]) return cache[decrypt];
+
     EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
     if (!ctx) return 0;
-    if (!EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), 0, key, 0)) {
-        DEBUG ("** EVP_DecryptInit_ex error\n");
+    int ok;
+    if (decrypt)
+        ok = EVP_DecryptInit_ex (ctx, type, 0, key, 0);
+    else
+        ok = EVP_EncryptInit_ex (ctx, type, 0, key, 0);
+    if (!ok) {
+        DEBUG ("** cipher initialization error\n");
+        EVP_CIPHER_CTX_free (ctx);
+        return 0;
+    }
+    cache[decrypt] = ctx;
+    return ctx;
+}
+
+static EVP_CIPHER_CTX *housetuya_cipher_ecb (struct TuyaCipher *cipher,
+                                             int decrypt) {
+    return housetuya_cipher_context
+               (cipher->ecb, EVP_aes_128_ecb(), cipher->key, decrypt);
+}
+
+static EVP_CIPHER_CTX *housetuya_cipher_gcm (struct TuyaCipher *cipher,
+                                             int decrypt) {
+    return housetuya_cipher_context
+               (cipher->gcm, EVP_aes_128_gcm(), cipher->key, decrypt);
+}
+
+struct TuyaCipher *housetuya_discoverycipher (void) {
+
+    static struct TuyaCipher *DiscoveryCipher = 0;
+    if (!DiscoveryCipher) {
+        DiscoveryCipher =
+            housetuya_cipher_new ((const unsigned char *)housetuya_discoverykey());
+        if (DiscoveryCipher) housetuya_cipher_ecb (DiscoveryCipher, 1);
+    }
+    return DiscoveryCipher;
+}
+
+int housetuya_encrypt (struct TuyaCipher *cipher,
+                       char *encrypted, const char *clear, int length) {
+    int cursor, crypted_length;
+    EVP_CIPHER_CTX *ctx = housetuya_cipher_ecb (cipher, 0);
+    if (!ctx) return 0;
+
+    // Reset the state left by the previous message, keep the expanded key.
+    if (!EVP_EncryptInit_ex(ctx, 0, 0, 0, 0)) {
+        DEBUG ("** EVP_EncryptInit_ex error\n");
         return 0;
     }
-    EVP_CIPHER_CTX_set_key_length (ctx, 16);
     if (!EVP_EncryptUpdate(ctx, encrypted, &cursor, clear, length)) {
         DEBUG ("** EVP_EncryptUpdate error\n");
         return 0;
@@ -95,20 +211,19 @@ int housetuya_encrypt (const unsigned char *key,
     }
     crypted_length += cursor;
     DEBUG ("Length after encoding: %d\n", crypted_length);
-    EVP_CIPHER_CTX_free(ctx);
     return crypted_length;
 }
 
-int housetuya_decrypt (const unsigned char *key,
+int housetuya_decrypt (struct TuyaCipher *cipher,
                        const char *encrypted, char *clear, int length) {
     int cursor, clear_length;
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX *ctx = housetuya_cipher_ecb (cipher, 1);
     if (!ctx) return 0;
-    if (!EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), 0, key, 0)) {
+
+    if (!EVP_DecryptInit_ex(ctx, 0, 0, 0, 0)) {
         DEBUG ("** EVP_DecryptInit_ex error\n");
         return 0;
     }
-    EVP_CIPHER_CTX_set_key_length (ctx, 16);
     if (!EVP_DecryptUpdate(ctx, clear, &cursor, encrypted, length)) {
         DEBUG ("** EVP_DecryptUpdate error\n");
         return 0;
@@ -119,12 +234,103 @@ int housetuya_decrypt (const unsigned char *key,
         return 0;
     }
     clear_length += cursor;
-    // Remove AES padding, if any.
-    if ((clear[clear_length-1] > 0) && (clear[clear_length-1] < 16))
-       clear_length -= clear[clear_length-1];
+    // The AES padding was already removed by EVP_DecryptFinal_ex. Do not
+    // guess any further: the 3.4 session negotiation data is binary.
     clear[clear_length] = 0;
     DEBUG ("Length after decoding: %d\n", clear_length);
-    EVP_CIPHER_CTX_free(ctx);
     return clear_length;
 }
 
+int housetuya_encrypt_gcm (struct TuyaCipher *cipher, const unsigned char *iv,
+                           const char *aad, int aadlength,
+                           char *encrypted, const char *clear, int length,
+                           unsigned char *tag) {
+    int cursor, crypted_length;
+    EVP_CIPHER_CTX *ctx = housetuya_cipher_gcm (cipher, 0);
+    if (!ctx) return 0;
+
+    // Only the IV changes: the expanded key is kept.
+    if (!EVP_EncryptInit_ex (ctx, 0, 0, 0, iv)) {
+        DEBUG ("** EVP_EncryptInit_ex (GCM) error\n");
+        return 0;
+    }
+    if (aad && !EVP_EncryptUpdate (ctx, 0, &cursor, aad, aadlength)) {
+        DEBUG ("** EVP_EncryptUpdate (GCM AAD) error\n");
+        return 0;
+    }
+    if (!EVP_EncryptUpdate (ctx, encrypted, &cursor, clear, length)) {
+        DEBUG ("** EVP_EncryptUpdate (GCM) error\n");
+        return 0;
+    }
+    crypted_length = cursor;
+    if (!EVP_EncryptFinal_ex (ctx, encrypted+cursor, &cursor)) {
+        DEBUG ("** EVP_EncryptFinal_ex (GCM) error\n");
+        return 0;
+    }
+    crypted_length += cursor;
+    if (tag && !EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_GCM_GET_TAG, 16, tag)) {
+        DEBUG ("** GCM tag error\n");
+        return 0;
+    }
+    return crypted_length;
+}
+
+int housetuya_decrypt_gcm (struct TuyaCipher *cipher, const unsigned char *iv,
+                           const char *aad, int aadlength,
+                           const char *encrypted, char *clear, int length,
+                           const unsigned char *tag) {
+    int cursor, clear_length;
+    EVP_CIPHER_CTX *ctx = housetuya_cipher_gcm (cipher, 1);
+    if (!ctx) return 0;
+
+    if (!EVP_DecryptInit_ex (ctx, 0, 0, 0, iv)) {
+        DEBUG ("** EVP_DecryptInit_ex (GCM) error\n");
+        return 0;
+    }
+    if (aad && !EVP_DecryptUpdate (ctx, 0, &cursor, aad, aadlength)) {
+        DEBUG ("** EVP_DecryptUpdate (GCM AAD) error\n");
+        return 0;
+    }
+    if (!EVP_DecryptUpdate (ctx, clear, &cursor, encrypted, length)) {
+        DEBUG ("** EVP_DecryptUpdate (GCM) error\n");
+        return 0;
+    }
+    clear_length = cursor;
+    if (!EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_GCM_SET_TAG, 16, (void *)tag)) {
+        DEBUG ("** GCM tag error\n");
+        return 0;
+    }
+    if (EVP_DecryptFinal_ex (ctx, clear+cursor, &cursor) <= 0) {
+        DEBUG ("** Invalid GCM tag\n");
+        return 0;
+    }
+    clear_length += cursor;
+    return clear_length;
+}
+
+void housetuya_random (unsigned char *buffer, int length) {
+    if (RAND_bytes (buffer, length) != 1) {
+        // Not good, but the nonce only needs to be different each time.
+        // This uses its own generator, seeded once, so that it does not
+        // disturb the application's use of random().
+        static unsigned short state[3] = {0, 0, 0};
+        static int seeded = 0;
+        int i;
+        DEBUG ("** RAND_bytes error\n");
+        if (!seeded) {
+            unsigned int seed = (unsigned int)time(0) ^ (unsigned int)getpid();
+            state[0] = 0x330e;
+            state[1] = (unsigned short)seed;
+            state[2] = (unsigned short)(seed >> 16);
+            seeded = 1;
+        }
+        for (i = 0; i < length; ++i) buffer[i] = (unsigned char)nrand48(state);
+    }
+}
+
+void housetuya_hmac (const unsigned char *key,
+                     const char *data, int length, unsigned char *digest) {
+    unsigned int size = 32;
+    HMAC (EVP_sha256(), key, 16, (const unsigned char *)data, length,
+          digest, &size);
+}
@@ -20,9 +20,27 @@
  * housetuya_crypto.h - Cryptographic support for the Tuya protocol
  */
 const char *housetuya_discoverykey (void);
+struct TuyaCipher *housetuya_discoverycipher (void);
 
-int housetuya_encrypt (const unsigned char *key,
-                       char *encrypted, char *clear, int length);
-int housetuya_decrypt (const unsigned char *key,
+struct TuyaCipher *housetuya_cipher_new (const unsigned char *key);
+void housetuya_cipher_free (struct TuyaCipher *cipher);
+
+int housetuya_encrypt (struct TuyaCipher *cipher,
+                       char *encrypted, const char *clear, int length);
+int housetuya_decrypt (struct TuyaCipher *cipher,
                        const char *encrypted, char *clear, int length);
 
+
+int housetuya_encrypt_gcm (struct TuyaCipher *cipher, const unsigned char *iv,
+                           const char *aad, int aadlength,
+                           char *encrypted, const char *clear, int length,
+                           unsigned char *tag);
+int housetuya_decrypt_gcm (struct TuyaCipher *cipher, const unsigned char *iv,
+                           const char *aad, int aadlength,
+                           const char *encrypted, char *clear, int length,
+                           const unsigned char *tag);
+
+void housetuya_random (unsigned char *buffer, int length);
+
+void housetuya_hmac (const unsigned char *key,
+                     const char *data, int length, unsigned char *digest);
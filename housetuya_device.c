@@ -24,17 +24,20 @@
  *
  * const char *housetuya_device_initialize (int argc, const char **argv);
  *
- *    Initialize this module at startup.
+ *    Initialize this module at startup. The -push option enables the push
+ *    mode, where the device status is normally reported by the device
+ *    itself and polling is only used as a fallback.
  *
  * int housetuya_device_changed (void);
  *
  *    Indicate if the configuration was changed due to discovery, which
  *    means it must be saved.
  *
- * void housetuya_device_live_config (ParserContext context, int top);
+ * void housetuya_device_live_config (TuyaJson *json);
  *
  *    Recover the current live config, typically to save it to disk after
- *    a change has been detected.
+ *    a change has been detected. This writes the "devices" array into the
+ *    current JSON object.
  *
  * const char *housetuya_device_refresh (void);
  *
@@ -48,6 +51,13 @@
  *
  *    Return the name of a tuya device.
  *
+ * int housetuya_device_search (const char *name);
+ * int housetuya_device_search_next (const char *name, int point);
+ *
+ *    Return the index of the first, or of the next, tuya device with the
+ *    specified name, or -1 if not found. Several devices may have the
+ *    same name, to be controlled together.
+ *
  * const char *housetuya_device_failure (int point);
  *
  *    Return a string describing the failure, or a null pointer if healthy.
@@ -58,15 +68,68 @@
  *    Return the last commanded state, or the command deadline, for
  *    the specified tuya device.
  *
+ * int housetuya_device_interval (int point);
+ *
+ *    Return the current delay between two queries of the device, in
+ *    seconds. This delay adapts to how often the device changes state.
+ *
+ * int housetuya_device_collapsed (int point);
+ *
+ *    Return how many commands were superseded by a newer command before
+ *    they could be sent to the device.
+ *
  * int housetuya_device_get (int point);
  *
  *    Get the actual state of the device.
  *
+ * long long housetuya_device_generation (void);
+ * long long housetuya_device_updated (int point);
+ *
+ *    Return the generation of the most recent change to the status of any
+ *    device, or of the specified device. The status here is everything
+ *    reported in /tuya/status. The generation only increases, so that a
+ *    client can tell if the status must be rendered again.
+ *
+ * long long housetuya_device_latest (void);
+ * long long housetuya_device_oldest (void);
+ *
+ *    Return the identifier of the most recent, or of the oldest retained,
+ *    device state change. Identifiers increase by one on every change,
+ *    starting with 1. Only the most recent changes are retained.
+ *
+ * int housetuya_device_change (long long id, time_t *timestamp,
+ *                              const char **action, const char **state);
+ *
+ *    Return the device that changed state, and the details of the change:
+ *    the event (CHANGED, CONFIRMED, SILENT or DETECTED) and the new state.
+ *    Return -1 if that change is no longer retained.
+ *
+ * const char *housetuya_device_dps (int point, int index,
+ *                                   TuyaDataPoint *value, time_t *updated);
+ *
+ *    Enumerate the data points last reported by the device: return the
+ *    name of the data point at the specified index, or 0 past the end.
+ *    The value remains valid until the next report from the device. The
+ *    updated time is when the value last changed.
+ *
  * int housetuya_device_set (int point, int state, int pulse);
  *
  *    Set the specified point to the on (1) or off (0) state for the pulse
  *    length specified. The pulse length is in seconds. If pulse is 0, the
  *    device is maintained to the requested state until a new state is issued.
+ *    A new command is sent immediately, unless a previous command to the
+ *    same device is still waiting for a response. In that case, only the
+ *    latest command is sent once the device has answered.
+ *
+ *    Return 1 on success, 0 if the device is not known and -1 on error.
+ *
+ * int housetuya_device_set_dps (int point, const TuyaDataPoint *dps, int count);
+ *
+ *    Set several data points of the device in one CONTROL request, for
+ *    example the power, brightness and color temperature of a bulb. If the
+ *    control data point is included, it is handled as a housetuya_device_set()
+ *    command without pulse. The request is held while the device link is
+ *    being established; a newer request replaces a request still held.
  *
  *    Return 1 on success, 0 if the device is not known and -1 on error.
  *
@@ -74,6 +137,12 @@
  *
  *    This function must be called every second. It runs the Kasa device
  *    discovery and ends the expired pulses.
+ *
+ *    The device timers are actually driven by a timer file descriptor on
+ *    the monotonic clock, with a millisecond resolution, so that pulse ends
+ *    and command retries do not wait for the next periodic call. The
+ *    periodic call remains as a fallback if that timer is not available,
+ *    or if there is no memory left to schedule every device.
  */
 
 #include <time.h>
@@ -83,6 +152,7 @@
 #include <string.h>
 #include <errno.h>
 
+#include <sys/timerfd.h>
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <netpacket/packet.h>
@@ -98,10 +168,40 @@
 
 #include "housetuya_crypto.h"
 #include "housetuya_messages.h"
+#include "housetuya_hash.h"
+#include "housetuya_json.h"
+#include "housetuya_broadcast.h"
 #include "housetuya_model.h"
 #include "housetuya_device.h"
 
 
+// The maximum number of data points in one CONTROL request.
+#define TUYA_MAX_BATCH 16
+
+// The maximum number of data points tracked for each device.
+#define TUYA_MAX_DPS 32
+
+// The minimum delay between two DATA events for the same data point.
+#define TUYA_DATA_EVENT_PERIOD 60
+
+struct DeviceDataPoint {
+    char key[12];
+    TuyaDataPoint point;
+    time_t updated;
+    time_t logged;      // When the last DATA event was recorded.
+};
+
+// Requests sent to a device and not answered yet. Requests are pipelined
+// on the device's connection, and each response is matched to its request
+// using the sequence number.
+#define TUYA_MAX_INFLIGHT 8
+
+struct DeviceRequest {
+    int sequence;
+    int code;
+    time_t sent;        // 0 if still queued in the output buffer.
+};
+
 struct DeviceMap {
     char *name;
     TuyaSecret secret;
@@ -111,14 +211,41 @@ struct DeviceMap {
     char *host;
     time_t detected;
     int socket;
+    int linked;         // The TCP connection is established.
+    int backoff;        // Delay before the next connection attempt.
+    time_t reconnect;   // Do not attempt to connect before that time.
+    time_t waiting;     // When the oldest unanswered request was sent.
+    time_t active;      // Last time something was sent or received.
     int encrypted;
     int status;
     int commanded;
+    int deferred;       // The commanded state waits for a CONTROL response.
+    int collapsed;      // Count of commands superseded before being sent.
+    long long controlled; // Monotonic clock (ms) of the latest CONTROL.
+    TuyaDataPoint batch[TUYA_MAX_BATCH]; // The latest data points set.
+    int batched;
+    int batchsequence;  // The CONTROL request carrying the batch, 0 if none.
+    time_t batchexpires; // Forget the batch if not delivered by that time.
+    struct DeviceDataPoint dps[TUYA_MAX_DPS]; // As last reported.
+    int dpscount;
+    long long updated;  // Generation of the last change to the status.
     time_t pending;
     time_t deadline;
-    time_t last_sense;
-    char out[1024];
+    long long pulse_end; // Monotonic clock (ms) when the pulse ends.
+    long long retry;    // Monotonic clock (ms) of the next command retry.
+    time_t next_sense;
+    int interval;       // Current delay between two queries, in seconds.
+    time_t last_status; // Last time the device reported its data points.
+    long long due;      // Monotonic clock (ms) of the next check.
+    int queued;         // Position in the scheduling queue, -1 if none,
+                        // TUYA_UNQUEUED if the queue could not grow.
+    int sequence;       // Sequence number of the last request.
+    struct DeviceRequest requests[TUYA_MAX_INFLIGHT]; // Oldest first.
+    int inflight;
+    char out[4096];     // Requests waiting to be sent, back to back.
     int outlength;
+    char in[4096];      // Data received, waiting for a complete message.
+    int inlength;
     int control; // Data point to use for on/off controls.
 };
 
@@ -131,11 +258,84 @@ static struct DeviceMap *Devices = 0;
 static int DevicesCount = 0;
 static int DevicesSpace = 0;
 
+// Indexes to find a device without scanning the whole list. The socket
+// index is a direct map from file descriptor to device (-1 if none).
+static TuyaHashIndex DevicesById = {0};
+static TuyaHashIndex DevicesByName = {0};
+static int *DevicesBySocket = 0;
+static int DevicesBySocketSize = 0;
+
+// The most recent device state changes, for clients that only want
+// to know what changed since their last request.
+#define TUYA_CHANGES 256
+
+struct DeviceChange {
+    long long id;
+    time_t timestamp;
+    int device;
+    const char *action;
+    const char *state;
+};
+static struct DeviceChange DeviceChanges[TUYA_CHANGES];
+static long long DeviceChangesLatest = 0;
+
+static long long DevicesGeneration = 0;
+
 static char *TuyaTcpPort = "6668";
+static int TuyaMaxBackoff = 60;   // Maximum delay between connection attempts.
+static int TuyaResponseTimeout = 10;
+static int TuyaHeartbeatPeriod = 15;  // Devices drop idle links after ~30s.
+
+// The query interval adapts to each device: it is reset to the minimum
+// when the device state changes on its own, and doubles after each query
+// otherwise, up to the maximum. A random jitter of +/- 1/8 of the interval
+// keeps the devices from being queried all at the same time.
+static int TuyaSenseMinimum = 10;
+static int TuyaSenseMaximum = 120;
+static int TuyaSilentPeriod = 100;    // About 3 senses.
+static int TuyaRetryPeriod = 5;
+static int TuyaRetryDelay = 1500;     // Milliseconds between two retries.
+
+// The devices waiting for their next check, as a min-heap ordered by
+// due time, so that the periodic processing only touches the devices
+// that need it. The timer is armed for the first device in the queue.
+static int *DevicesQueue = 0;
+static int DevicesQueued = 0;
+static int DevicesQueueSize = 0;
+
+// If the queue cannot grow, the devices left out are checked by a scan
+// of all devices on each periodic call, until they can be queued again.
+#define TUYA_UNQUEUED -2
+static int DevicesQueueFailed = 0;
+static int TuyaTimer = -1;
+static long long TuyaTimerArmed = 0;
+
+// In push mode, the device's own STATUS messages are the primary source
+// of state information, and a device is polled only if its link is not
+// established, or it has not reported anything for a long time.
+static int TuyaPushMode = 0;
+static int TuyaQuietPeriod = 300;
 static int TuyaUdpPort[2] = {6666, 6667};
 
 static int TuyaUdpSocket[2] = {-1, -1};
 
+// The discovery messages on port 6667 are all encrypted with the same key:
+// use one long-lived decryptor, set up when the socket is opened.
+static TuyaSecret TuyaDiscoverySecret = {0};
+
+// Devices repeat the same discovery broadcast every few seconds. Remember
+// which device sent which payload from which address, so that an unchanged
+// broadcast only refreshes the detection time. The cache is direct-mapped:
+// a collision just evicts the previous entry.
+#define TUYA_DISCOVERY_CACHE 256
+struct DiscoveryCacheEntry {
+    long ipaddress;
+    unsigned int hash;
+    int length;
+    int device;
+};
+static struct DiscoveryCacheEntry TuyaDiscoveryCache[TUYA_DISCOVERY_CACHE];
+
 
 static const char *housetuya_hexdump (const char *data, int length) {
 
@@ -158,60 +358,393 @@ int housetuya_device_changed (void) {
 }
 
 const char *housetuya_device_name (int point) {
-    if (point < 0 || point > DevicesCount) return 0;
+    if (point < 0 || point >= DevicesCount) return 0;
     return Devices[point].name;
 }
 
 int housetuya_device_commanded (int point) {
-    if (point < 0 || point > DevicesCount) return 0;
+    if (point < 0 || point >= DevicesCount) return 0;
     return Devices[point].commanded;
 }
 
 time_t housetuya_device_deadline (int point) {
-    if (point < 0 || point > DevicesCount) return 0;
+    if (point < 0 || point >= DevicesCount) return 0;
     return Devices[point].deadline;
 }
 
+static void housetuya_device_touch (int device) {
+    Devices[device].updated = ++DevicesGeneration;
+}
+
+long long housetuya_device_generation (void) {
+    return DevicesGeneration;
+}
+
+long long housetuya_device_updated (int point) {
+    if (point < 0 || point >= DevicesCount) return 0;
+    return Devices[point].updated;
+}
+
+static void housetuya_device_record (int device, const char *action) {
+
+    struct DeviceChange *change =
+        DeviceChanges + ((++DeviceChangesLatest) % TUYA_CHANGES);
+
+    change->id = DeviceChangesLatest;
+    change->timestamp = time(0);
+    change->device = device;
+    change->action = action;
+    change->state = housetuya_device_failure (device);
+    if (!change->state) change->state = Devices[device].status?"on":"off";
+    housetuya_device_touch (device);
+}
+
+long long housetuya_device_latest (void) {
+    return DeviceChangesLatest;
+}
+
+long long housetuya_device_oldest (void) {
+    if (DeviceChangesLatest < TUYA_CHANGES) return 1;
+    return DeviceChangesLatest - TUYA_CHANGES + 1;
+}
+
+int housetuya_device_change (long long id, time_t *timestamp,
+                             const char **action, const char **state) {
+
+    if ((id < housetuya_device_oldest()) || (id > DeviceChangesLatest))
+        return -1;
+
+    struct DeviceChange *change = DeviceChanges + (id % TUYA_CHANGES);
+    if (timestamp) *timestamp = change->timestamp;
+    if (action) *action = change->action;
+    if (state) *state = change->state;
+    return change->device;
+}
+
 const char *housetuya_device_failure (int point) {
-    if (point < 0 || point > DevicesCount) return 0;
+    if (point < 0 || point >= DevicesCount) return 0;
     if (!Devices[point].detected) return "silent";
     return 0;
 }
 
+int housetuya_device_interval (int point) {
+    if (point < 0 || point >= DevicesCount) return 0;
+    return Devices[point].interval;
+}
+
+int housetuya_device_collapsed (int point) {
+    if (point < 0 || point >= DevicesCount) return 0;
+    return Devices[point].collapsed;
+}
+
 int housetuya_device_get (int point) {
-    if (point < 0 || point > DevicesCount) return 0;
+    if (point < 0 || point >= DevicesCount) return 0;
     return Devices[point].status;
 }
 
+const char *housetuya_device_dps (int point, int index,
+                                  TuyaDataPoint *value, time_t *updated) {
+    if (point < 0 || point >= DevicesCount) return 0;
+    if (index < 0 || index >= Devices[point].dpscount) return 0;
+    struct DeviceDataPoint *dps = Devices[point].dps + index;
+    if (value) *value = dps->point;
+    if (updated) *updated = dps->updated;
+    return dps->key;
+}
+
+static void housetuya_device_index (int i) {
+    housetuya_hash_add (&DevicesById, housetuya_hash (Devices[i].secret.id), i);
+    housetuya_hash_add (&DevicesByName, housetuya_hash (Devices[i].name), i);
+}
+
+static void housetuya_device_reindex (void) {
+    int i;
+    housetuya_hash_clear (&DevicesById, DevicesSpace);
+    housetuya_hash_clear (&DevicesByName, DevicesSpace);
+    for (i = 0; i < DevicesCount; ++i) housetuya_device_index (i);
+}
+
 static int housetuya_device_id_search (const char *id) {
     int i;
-    for (i = 0; i < DevicesCount; ++i) {
+    for (i = housetuya_hash_first (&DevicesById, housetuya_hash (id));
+         i >= 0; i = housetuya_hash_next (&DevicesById, i)) {
         if (!strcmp(id, Devices[i].secret.id)) return i;
     }
     return -1;
 }
 
-static int housetuya_device_socket_search (int s) {
+int housetuya_device_search (const char *name) {
     int i;
-    for (i = 0; i < DevicesCount; ++i) {
-        if (Devices[i].socket == s) return i;
+    for (i = housetuya_hash_first (&DevicesByName, housetuya_hash (name));
+         i >= 0; i = housetuya_hash_next (&DevicesByName, i)) {
+        if (!strcmp(name, Devices[i].name)) return i;
     }
     return -1;
 }
 
+int housetuya_device_search_next (const char *name, int point) {
+    int i;
+    if (point < 0 || point >= DevicesCount) return -1;
+    for (i = housetuya_hash_next (&DevicesByName, point);
+         i >= 0; i = housetuya_hash_next (&DevicesByName, i)) {
+        if (!strcmp(name, Devices[i].name)) return i;
+    }
+    return -1;
+}
+
+static void housetuya_device_socket_index (int s, int device) {
+    if (s < 0) return;
+    if (s >= DevicesBySocketSize) {
+        if (device < 0) return; // Nothing to remove.
+        int size = s + 64;
+        int *map = realloc (DevicesBySocket, size * sizeof(int));
+        if (!map) return;
+        memset (map + DevicesBySocketSize, 0xff,
+                (size - DevicesBySocketSize) * sizeof(int));
+        DevicesBySocket = map;
+        DevicesBySocketSize = size;
+    }
+    DevicesBySocket[s] = device;
+}
+
+static int housetuya_device_socket_search (int s) {
+    if ((s < 0) || (s >= DevicesBySocketSize)) return -1;
+    int i = DevicesBySocket[s];
+    if ((i < 0) || (i >= DevicesCount) || (Devices[i].socket != s)) return -1;
+    return i;
+}
+
 static void housetuya_device_close (int i) {
     if (Devices[i].socket >= 0) {
         echttp_forget (Devices[i].socket);
+        housetuya_device_socket_index (Devices[i].socket, -1);
         close (Devices[i].socket);
         Devices[i].socket = -1;
         Devices[i].outlength = 0;
+        Devices[i].inlength = 0;
+    }
+    housetuya_session_reset (&(Devices[i].secret));
+    Devices[i].linked = 0;
+    Devices[i].waiting = 0;
+    Devices[i].inflight = 0;
+    Devices[i].deferred = 0; // The retry will send the latest command.
+    Devices[i].batchsequence = 0; // Not answered: the batch is held again.
+}
+
+// Close a connection that failed, and delay the next connection attempt.
+// The delay doubles on each consecutive failure, up to a maximum.
+//
+static void housetuya_device_fail (int i, const char *reason) {
+    if (Devices[i].backoff <= 0)
+        Devices[i].backoff = 1;
+    else if (Devices[i].backoff < TuyaMaxBackoff)
+        Devices[i].backoff *= 2;
+    if (Devices[i].backoff > TuyaMaxBackoff)
+        Devices[i].backoff = TuyaMaxBackoff;
+    Devices[i].reconnect = time(0) + Devices[i].backoff;
+    if (echttp_isdebug())
+        houselog_trace (HOUSE_INFO, "PROTOCOL", "link to %s failed (%s), retry in %d seconds", Devices[i].secret.id, reason, Devices[i].backoff);
+    housetuya_device_close (i);
+}
+
+// Forget the data points set for this device, once delivered, expired
+// or superseded by a newer command.
+//
+static void housetuya_device_batch_clear (struct DeviceMap *dev) {
+    int i;
+    for (i = 0; i < dev->batched; ++i) {
+        if (dev->batch[i].type == TUYA_DPS_STRING)
+            free ((char *)(dev->batch[i].value.string));
     }
+    dev->batched = 0;
+    dev->batchsequence = 0;
 }
 
 static void housetuya_device_reset (int i, int status) {
+    housetuya_device_batch_clear (Devices + i);
+    if ((Devices[i].status != status) || (Devices[i].commanded != status) ||
+        Devices[i].deadline)
+        housetuya_device_touch (i);
     Devices[i].commanded = Devices[i].status = status;
     Devices[i].pending = Devices[i].deadline = 0;
-    housetuya_device_close (i);
+    Devices[i].pulse_end = Devices[i].retry = 0;
+}
+
+// ******* DEVICE SCHEDULING
+
+// Return the monotonic clock in milliseconds. This clock is not affected
+// by changes to the system time.
+//
+static long long housetuya_device_clock (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Arm the timer for the first device due.
+//
+static void housetuya_device_arm (void) {
+
+    if ((TuyaTimer < 0) || (DevicesQueued <= 0)) return;
+
+    long long due = Devices[DevicesQueue[0]].due;
+    if (due == TuyaTimerArmed) return;
+
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = due / 1000;
+    spec.it_value.tv_nsec = (due % 1000) * 1000000;
+    if (timerfd_settime (TuyaTimer, TFD_TIMER_ABSTIME, &spec, 0) < 0) return;
+    TuyaTimerArmed = due;
+}
+
+static void housetuya_device_queue_swap (int a, int b) {
+    int device = DevicesQueue[a];
+    DevicesQueue[a] = DevicesQueue[b];
+    DevicesQueue[b] = device;
+    Devices[DevicesQueue[a]].queued = a;
+    Devices[DevicesQueue[b]].queued = b;
+}
+
+static void housetuya_device_queue_up (int slot) {
+    while (slot > 0) {
+        int parent = (slot - 1) / 2;
+        if (Devices[DevicesQueue[parent]].due <= Devices[DevicesQueue[slot]].due)
+            break;
+        housetuya_device_queue_swap (parent, slot);
+        slot = parent;
+    }
+}
+
+static void housetuya_device_queue_down (int slot) {
+    for (;;) {
+        int child = (2 * slot) + 1;
+        if (child >= DevicesQueued) break;
+        if ((child + 1 < DevicesQueued) &&
+            (Devices[DevicesQueue[child+1]].due < Devices[DevicesQueue[child]].due))
+            child += 1;
+        if (Devices[DevicesQueue[slot]].due <= Devices[DevicesQueue[child]].due)
+            break;
+        housetuya_device_queue_swap (slot, child);
+        slot = child;
+    }
+}
+
+// Make sure that the device is checked no later than the specified time.
+// A device that is already due earlier is left alone: the next check will
+// compute its new due time anyway.
+//
+static void housetuya_device_schedule (int device, long long when) {
+
+    struct DeviceMap *dev = Devices + device;
+
+    if (dev->queued >= 0) {
+        if (when >= dev->due) return;
+        dev->due = when;
+        housetuya_device_queue_up (dev->queued);
+        if (dev->queued == 0) housetuya_device_arm ();
+        return;
+    }
+    if ((dev->queued == TUYA_UNQUEUED) && (dev->due < when)) when = dev->due;
+    if (DevicesQueued >= DevicesQueueSize) {
+        int size = DevicesQueueSize + 16;
+        int *queue = realloc (DevicesQueue, size * sizeof(int));
+        if (!queue) {
+            if (!DevicesQueueFailed)
+                houselog_trace (HOUSE_FAILURE, "TIMER",
+                                "no memory to schedule %d devices", size);
+            DevicesQueueFailed = 1;
+            dev->due = when;
+            dev->queued = TUYA_UNQUEUED;
+            return;
+        }
+        DevicesQueue = queue;
+        DevicesQueueSize = size;
+    }
+    dev->due = when;
+    dev->queued = DevicesQueued++;
+    DevicesQueue[dev->queued] = device;
+    housetuya_device_queue_up (dev->queued);
+    if (dev->queued == 0) housetuya_device_arm ();
+}
+
+// Remove and return the first device that is due, or -1 if none is.
+//
+static int housetuya_device_queue_pop (long long clock) {
+
+    if (DevicesQueued <= 0) return -1;
+
+    int device = DevicesQueue[0];
+    if (Devices[device].due > clock) return -1;
+
+    DevicesQueued -= 1;
+    if (DevicesQueued > 0) {
+        DevicesQueue[0] = DevicesQueue[DevicesQueued];
+        Devices[DevicesQueue[0]].queued = 0;
+        housetuya_device_queue_down (0);
+    }
+    Devices[device].queued = -1;
+    return device;
+}
+
+// Return the time of the next action for this device: the earliest of
+// all the timers that housetuya_device_check() handles.
+//
+static long long housetuya_device_next_check (int device,
+                                              time_t now, long long clock) {
+
+    struct DeviceMap *dev = Devices + device;
+    int commanding = dev->pending && (dev->status != dev->commanded);
+
+    // Most timers have a one second resolution.
+    time_t next = dev->next_sense;
+
+    if (dev->waiting && (dev->waiting + TuyaResponseTimeout + 1 < next))
+        next = dev->waiting + TuyaResponseTimeout + 1;
+    if (dev->linked && (dev->active + TuyaHeartbeatPeriod < next))
+        next = dev->active + TuyaHeartbeatPeriod;
+    if ((dev->detected > 0) && (dev->detected + TuyaSilentPeriod + 1 < next))
+        next = dev->detected + TuyaSilentPeriod + 1;
+    if (commanding && (dev->pending < next))
+        next = dev->pending;
+    if (dev->batched) {
+        if (dev->batchexpires < next) next = dev->batchexpires;
+        if ((!dev->batchsequence) && (dev->reconnect < next))
+            next = dev->reconnect;
+    }
+    if (next <= now) next = now + 1;
+
+    long long due = clock + ((long long)(next - now) * 1000);
+
+    // The pulse end and the command retries are more precise.
+    if (dev->pulse_end && (dev->pulse_end < due))
+        due = dev->pulse_end;
+    if (commanding && (dev->pending > now) && (dev->retry < due))
+        due = dev->retry;
+    if (due <= clock) due = clock + 1;
+    return due;
+}
+
+// Plan the next query, and back off for the following one: a device that
+// did not change on its own since the last query is probably stable.
+//
+static void housetuya_device_plan_sense (int device, time_t now) {
+
+    struct DeviceMap *dev = Devices + device;
+    int spread = dev->interval / 4;
+
+    dev->next_sense = now + dev->interval;
+    if (spread > 0) dev->next_sense += (random() % (spread + 1)) - (spread / 2);
+
+    if (dev->interval < TuyaSenseMaximum) {
+        dev->interval *= 2;
+        if (dev->interval > TuyaSenseMaximum) dev->interval = TuyaSenseMaximum;
+        housetuya_device_touch (device); // The interval is in the status.
+    }
+}
+
+static void housetuya_device_reschedule (int device) {
+    housetuya_device_schedule (device,
+        housetuya_device_next_check (device, time(0), housetuya_device_clock()));
 }
 
 static int housetuya_device_add (const char *name,
@@ -227,28 +760,41 @@ static int housetuya_device_add (const char *name,
     Devices[i].secret.id = strdup (id);
     Devices[i].model = strdup (model);
     Devices[i].socket = -1;
+    Devices[i].queued = -1;
+    Devices[i].interval = TuyaSenseMinimum;
+    housetuya_device_touch (i);
+    housetuya_device_schedule (i, housetuya_device_clock());
+    if (2 * DevicesCount > DevicesById.size)
+        housetuya_device_reindex (); // Keep the hash chains short.
+    else
+        housetuya_device_index (i);
     DeviceListChanged = 1;
     return i;
 }
 
-static void housetuya_device_refresh_string (char **store, const char *value) {
+static int housetuya_device_refresh_string (char **store, const char *value) {
     if (value) {
         if (*store) {
-            if (! strcmp (*store, value)) return; // No change needed
+            if (! strcmp (*store, value)) return 0; // No change needed
             free (*store);
         }
         *store = strdup(value);
         DeviceListChanged = 1;
+        return 1;
     } else {
         if (*store) {
             free (*store);
             *store = 0;
+            return 1;
         }
     }
+    return 0;
 }
 
 // ******* DEVICE DISCOVERY
 
+static void housetuya_device_batch (int device);
+
 static void housetuya_device_discovery (int fd, int mode) {
 
     int code;
@@ -257,64 +803,77 @@ static void housetuya_device_discovery (int fd, int mode) {
     struct sockaddr_in addr;
     int addrlen = sizeof(addr);
 
-    int size = recvfrom (fd, raw, sizeof(raw), 0,
-                         (struct sockaddr *)(&addr), &addrlen);
+    int received = recvfrom (fd, raw, sizeof(raw), 0,
+                             (struct sockaddr *)(&addr), &addrlen);
+    if (received <= 0) return;
+    int size = received; // Changed by the decoding below.
+
+    unsigned int hash =
+        housetuya_hash_data (addr.sin_addr.s_addr, raw, size);
+    struct DiscoveryCacheEntry *cached =
+        TuyaDiscoveryCache + (hash % TUYA_DISCOVERY_CACHE);
+
+    if ((cached->length == size) && (cached->hash == hash) &&
+        (cached->ipaddress == addr.sin_addr.s_addr)) {
+        // Same broadcast as before: nothing changed, except that the device
+        // is still there. A device that went silent takes the long path
+        // so that its return is reported.
+        if (cached->device < 0) return; // Could not be decoded, see below.
+        struct DeviceMap *device = Devices + cached->device;
+        if (device->detected && (device->ipaddress == cached->ipaddress)) {
+            device->detected = time(0);
+            return;
+        }
+    }
 
     if (fd == TuyaUdpSocket[0]) {
         size = housetuya_extract (input, sizeof(input), 0, &code, 0, raw, size);
     } else if (fd == TuyaUdpSocket[1]) {
-        static TuyaSecret DiscoverySecret = {0};
-        if (!DiscoverySecret.key)
-            DiscoverySecret.key = strdup(housetuya_discoverykey());
-        size = housetuya_extract (input, sizeof(input), &DiscoverySecret, &code, 0, raw, size);
+        size = housetuya_extract (input, sizeof(input), &TuyaDiscoverySecret, &code, 0, raw, size);
     } else {
         return;
     }
-    if (size <= 4) return;
-    int ip = htonl(addr.sin_addr.s_addr);
-
-    ParserToken json[16];
-    int jsoncount = 16;
-
-    const char *error = echttp_json_parse (input, json, &jsoncount);
-    if (error) {
-        houselog_trace (HOUSE_FAILURE, "DISCOVERY", "%s: %s", error, input);
-        return;
+    if ((size <= 4) || (size >= sizeof(input))) return;
+    input[size] = 0;
+
+    TuyaBroadcast items;
+    if (!housetuya_broadcast_scan (input, &items)) {
+        // Not the usual format: use the generic (and slower) JSON parser.
+        char *original = strdup(input); // Parsing will destruct the string.
+        const char *error = housetuya_broadcast_parse (input, &items);
+        if (error) {
+            // Devices repeat the same broadcast every few seconds: the
+            // failure is cached, so that it is reported only once.
+            houselog_trace (HOUSE_FAILURE, "DISCOVERY", "%s: %s",
+                            error, original ? original : "(no memory)");
+            if (original) free (original);
+            cached->ipaddress = addr.sin_addr.s_addr;
+            cached->hash = hash;
+            cached->length = received;
+            cached->device = -1;
+            return;
+        }
+        if (original) free (original);
     }
-    int id = echttp_json_search (json, ".gwId");
-    if ((id < 0) || (json[id].type != PARSER_STRING)) return;
-
-    int product = echttp_json_search (json, ".productKey");
-    if ((product < 0) || (json[id].type != PARSER_STRING)) return;
-
-    int need_encryption = 0;
-    int encrypt = echttp_json_search (json, ".encrypt");
-    if (json[encrypt].type == PARSER_BOOL)
-        need_encryption = json[encrypt].value.bool;
 
-    int version = echttp_json_search (json, ".version");
-    if ((version < 0) || (json[version].type != PARSER_STRING)) return;
-
-    int index = housetuya_device_id_search (json[id].value.string);
+    int index = housetuya_device_id_search (items.id);
     if (index < 0) {
         // Newly discovered device.
         char name[64];
 
         snprintf (name, sizeof(name), "new_%d", DevicesCount);
-        index =  housetuya_device_add (name,
-                                       json[id].value.string,
-                                       json[product].value.string);
+        index =  housetuya_device_add (name, items.id, items.product);
     }
 
     // The following items always come from the device, overwrite existing.
     //
+    housetuya_device_refresh_string (&(Devices[index].model), items.product);
     housetuya_device_refresh_string
-        (&(Devices[index].model), json[product].value.string);
-    housetuya_device_refresh_string
-        (&(Devices[index].secret.version), json[version].value.string);
-    Devices[index].encrypted = need_encryption;
+        (&(Devices[index].secret.version), items.version);
+    Devices[index].encrypted = items.encrypt;
 
     if (Devices[index].ipaddress != addr.sin_addr.s_addr) {
+        housetuya_device_close (index); // Linked to the old address.
         Devices[index].ipaddress = addr.sin_addr.s_addr;
         housetuya_device_refresh_string
             (&(Devices[index].host), inet_ntoa(addr.sin_addr));
@@ -322,9 +881,19 @@ static void housetuya_device_discovery (int fd, int mode) {
     if (!Devices[index].detected) {
         houselog_event ("DEVICE", Devices[index].name, "DETECTED",
                         "ADDRESS %s", Devices[index].host);
-        Devices[index].last_sense = 0; // Force immediate query.
+        Devices[index].next_sense = 0; // Force immediate query.
+        Devices[index].detected = time(0);
+        housetuya_device_record (index, "DETECTED");
+        if (Devices[index].batched && (!Devices[index].batchsequence))
+            housetuya_device_batch (index);
     }
     Devices[index].detected = time(0);
+    housetuya_device_reschedule (index);
+
+    cached->ipaddress = addr.sin_addr.s_addr;
+    cached->hash = hash;
+    cached->length = received;
+    cached->device = index;
 }
 
 static void housetuya_device_discovery_sockets (void) {
@@ -335,6 +904,10 @@ static void housetuya_device_discovery_sockets (void) {
     listenaddr.sin_family = AF_INET;
     listenaddr.sin_addr.s_addr = INADDR_ANY;
 
+    // The discovery key is a binary MD5 digest: do not treat it as a string.
+    TuyaDiscoverySecret.key = (char *)housetuya_discoverykey();
+    TuyaDiscoverySecret.cipher = housetuya_discoverycipher();
+
     for (i = 0; i < 2; ++i) {
         listenaddr.sin_port = htons(TuyaUdpPort[i]);
         TuyaUdpSocket[i] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -369,63 +942,342 @@ static void housetuya_device_discovery_sockets (void) {
 
 // ******* DEVICE POLLING AND CONTROL
 
+static int housetuya_device_controlling (int device);
+
+// Update the device state from a device report.
+//
 static void housetuya_device_status_update (int device, int status) {
+    const char *action = 0;
     if (device < 0) return;
     if (status != Devices[device].status) {
-        if (Devices[device].pending &&
+        if (Devices[device].pending && (status != Devices[device].commanded) &&
+                (Devices[device].deferred ||
+                 housetuya_device_controlling (device))) {
+            // Most likely the result of an earlier command, since superseded
+            // by a newer command that is still in flight, or not sent yet.
+            // The device sends its STATUS report after the response to the
+            // CONTROL request, so this report cannot be matched to the
+            // request itself.
+        } else if (Devices[device].pending &&
                 (status == Devices[device].commanded)) {
             houselog_event ("DEVICE", Devices[device].name,
                             "CONFIRMED", "FROM %s TO %s",
                             Devices[device].status?"on":"off",
                             status?"on":"off");
             Devices[device].pending = 0;
+            action = "CONFIRMED";
         } else {
             houselog_event ("DEVICE", Devices[device].name,
                             "CHANGED", "FROM %s TO %s",
                             Devices[device].status?"on":"off",
                             status?"on":"off");
-            // Device commanded by someone else.
+            // Device commanded by someone else. It might change again soon:
+            // query it more often for a while.
             Devices[device].commanded = status;
             Devices[device].pending = 0;
+            housetuya_device_batch_clear (Devices + device);
+            action = "CHANGED";
+            Devices[device].interval = TuyaSenseMinimum;
+            time_t soon = time(0) + TuyaSenseMinimum;
+            if (Devices[device].next_sense > soon) {
+                Devices[device].next_sense = soon;
+                housetuya_device_reschedule (device);
+            }
         }
         Devices[device].status = status;
+        housetuya_device_touch (device);
     }
+    if (!Devices[device].detected) housetuya_device_touch (device);
     Devices[device].detected = time(0);
+    if (action) housetuya_device_record (device, action);
 }
 
-static void housetuya_device_receive (int fd, int mode) {
+// Update one data point from a device report. Return the data point if
+// its value changed, 0 otherwise (including when the data point is new).
+//
+static struct DeviceDataPoint *housetuya_device_dps_set (struct DeviceMap *dev,
+                                     const char *key, const ParserToken *token,
+                                     time_t now) {
 
-    char raw[1600];
-    int length = read (fd, raw, sizeof(raw));
-    int device = housetuya_device_socket_search (fd);
-    if (device < 0) {
-        echttp_forget (fd);
-        close (fd);
+    TuyaDataPoint value;
+    int i;
+
+    value.id = atoi (key);
+    switch (token->type) {
+    case PARSER_BOOL:
+        value.type = TUYA_DPS_BOOL;
+        value.value.bool = token->value.bool;
+        break;
+    case PARSER_INTEGER:
+        value.type = TUYA_DPS_INTEGER;
+        value.value.integer = (int)(token->value.integer);
+        break;
+    case PARSER_REAL:
+        value.type = TUYA_DPS_REAL;
+        value.value.real = token->value.real;
+        break;
+    case PARSER_STRING:
+        value.type = TUYA_DPS_STRING;
+        value.value.string = token->value.string;
+        break;
+    default:
+        return 0; // Not a data point value.
+    }
+    if (value.id <= 0) return 0;
+
+    for (i = 0; i < dev->dpscount; ++i) {
+        if (dev->dps[i].point.id == value.id) break;
+    }
+    struct DeviceDataPoint *dps = dev->dps + i;
+
+    if (i >= dev->dpscount) {
+        if (dev->dpscount >= TUYA_MAX_DPS) return 0;
+        dev->dpscount += 1;
+        snprintf (dps->key, sizeof(dps->key), "%d", value.id);
+        dps->logged = 0;
+    } else {
+        const TuyaDataPoint *old = &(dps->point);
+        if (old->type == value.type) {
+            switch (value.type) {
+            case TUYA_DPS_BOOL:
+                if (old->value.bool == value.value.bool) return 0;
+                break;
+            case TUYA_DPS_INTEGER:
+                if (old->value.integer == value.value.integer) return 0;
+                break;
+            case TUYA_DPS_REAL:
+                if (old->value.real == value.value.real) return 0;
+                break;
+            case TUYA_DPS_STRING:
+                if (!strcmp (old->value.string, value.value.string)) return 0;
+                break;
+            }
+        }
+        if (old->type == TUYA_DPS_STRING) free ((char *)(old->value.string));
+        i = -1; // Changed.
+    }
+    if (value.type == TUYA_DPS_STRING)
+        value.value.string = strdup (value.value.string);
+    dps->point = value;
+    dps->updated = now;
+    housetuya_device_touch (dev - Devices);
+    return (i < 0) ? dps : 0;
+}
+
+// Update the data points table from a device report, and record an event
+// for every data point that changed. The control data point is not listed
+// here: it has its own CHANGED and CONFIRMED events. Some devices report
+// measurements (power, current..) every few seconds: at most one event
+// per data point is recorded per TUYA_DATA_EVENT_PERIOD, the latest value
+// being always available from the data points table.
+//
+static void housetuya_device_dps_update (int device, const ParserToken *dps) {
+
+    struct DeviceMap *dev = Devices + device;
+    int count = dps->length;
+    int i;
+
+    if (count <= 0) return;
+    int index[count];
+
+    const char *error = echttp_json_enumerate (dps, index, count);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, "PROTOCOL", "%s: %s", dev->name, error);
         return;
     }
+    time_t now = time(0);
+    for (i = 0; i < count; ++i) {
+        const ParserToken *item = dps + index[i];
+        if (!item->key) continue;
+        struct DeviceDataPoint *changed =
+            housetuya_device_dps_set (dev, item->key, item, now);
+        if (!changed) continue;
+        if (atoi(item->key) == dev->control) continue;
+        if (now < changed->logged + TUYA_DATA_EVENT_PERIOD) continue;
+        changed->logged = now;
+
+        switch (item->type) {
+        case PARSER_BOOL:
+            houselog_event ("DEVICE", dev->name, "DATA", "%s = %s",
+                            item->key, item->value.bool?"true":"false");
+            break;
+        case PARSER_STRING:
+            houselog_event ("DEVICE", dev->name, "DATA", "%s = %s",
+                            item->key, item->value.string);
+            break;
+        case PARSER_REAL:
+            houselog_event ("DEVICE", dev->name, "DATA", "%s = %.15g",
+                            item->key, item->value.real);
+            break;
+        case PARSER_INTEGER:
+            houselog_event ("DEVICE", dev->name, "DATA", "%s = %lld",
+                            item->key, (long long)(item->value.integer));
+            break;
+        }
+    }
+}
+
+// Return the sequence number for a new request. Sequence numbers start
+// at 1: some devices use 0 in messages that do not answer a request.
+//
+static int housetuya_device_sequence (struct DeviceMap *dev) {
+    if (++(dev->sequence) <= 0) dev->sequence = 1;
+    return dev->sequence;
+}
+
+// Account for a request that was just encoded at the end of the output
+// buffer. A code of 0 means that no response is expected.
+//
+static int housetuya_device_enqueue (int device, int code, int sequence,
+                                     int length) {
+
+    struct DeviceMap *dev = Devices + device;
+
     if (length <= 0) {
-        housetuya_device_close (device);
+        houselog_trace (HOUSE_FAILURE, "PROTOCOL",
+                        "cannot queue request %d to %s", code, dev->secret.id);
+        return 0;
+    }
+    dev->outlength += length;
+    if (!code) return 1;
+
+    if (dev->inflight >= TUYA_MAX_INFLIGHT) {
+        // The oldest request was most likely lost.
+        dev->inflight -= 1;
+        memmove (dev->requests, dev->requests + 1,
+                 dev->inflight * sizeof(struct DeviceRequest));
+    }
+    struct DeviceRequest *request = dev->requests + (dev->inflight++);
+    request->sequence = sequence;
+    request->code = code;
+    request->sent = 0;
+    if (code == TUYA_CONTROL) dev->controlled = housetuya_device_clock();
+    return 1;
+}
+
+// Remove the request matching a response, and return its code (or 0 if
+// there was no such request) and its sequence number. A device that does
+// not echo the sequence number is assumed to answer its requests in order.
+//
+static int housetuya_device_answered (int device, int code, int sequence,
+                                      int *request) {
+
+    struct DeviceMap *dev = Devices + device;
+    int i;
+
+    for (i = 0; i < dev->inflight; ++i) {
+        if (dev->requests[i].sequence == sequence) break;
+    }
+    if (i >= dev->inflight) {
+        if ((code == TUYA_STATUS) || (dev->inflight <= 0)) return 0;
+        i = 0;
+    }
+    int answered = dev->requests[i].code;
+    *request = dev->requests[i].sequence;
+
+    dev->inflight -= 1;
+    memmove (dev->requests + i, dev->requests + i + 1,
+             (dev->inflight - i) * sizeof(struct DeviceRequest));
+    dev->waiting = dev->inflight ? dev->requests[0].sent : 0;
+    return answered;
+}
+
+// Return true if a CONTROL request to this device was not answered yet.
+//
+static int housetuya_device_controlling (int device) {
+
+    struct DeviceMap *dev = Devices + device;
+    int i;
+
+    for (i = 0; i < dev->inflight; ++i) {
+        if (dev->requests[i].code == TUYA_CONTROL) return 1;
+    }
+    return 0;
+}
+
+// Send the queued requests, if the link is established. Otherwise
+// the requests remain queued until the connection completes.
+//
+static void housetuya_device_flush (int device) {
+
+    struct DeviceMap *dev = Devices + device;
+
+    if ((!dev->linked) || (dev->outlength <= 0)) return;
+
+    if (write (dev->socket, dev->out, dev->outlength) != dev->outlength) {
+        housetuya_device_fail (device, strerror(errno));
         return;
     }
+    dev->outlength = 0;
+    dev->active = time(0);
+
+    int i;
+    for (i = 0; i < dev->inflight; ++i) {
+        if (!dev->requests[i].sent) dev->requests[i].sent = dev->active;
+    }
+    if (dev->inflight <= 0) return;
+    dev->waiting = dev->requests[0].sent;
+    housetuya_device_schedule
+        (device, housetuya_device_clock() + (TuyaResponseTimeout + 1) * 1000LL);
+}
+
+static void housetuya_device_resume (int device);
+static void housetuya_device_control (int device, int state);
+
+static void housetuya_device_process (int device, const char *raw, int length) {
+
     struct DeviceMap *dev = Devices + device;
-    if (echttp_isdebug())
-        houselog_trace (HOUSE_INFO, "PROTOCOL", "received from %s (%d bytes): %s", dev->secret.id, length, housetuya_hexdump(raw, length));
-    char payload[1600];
-    int code;
-    int sequence;
+    char payload[sizeof(dev->in)];
+    int code = 0;
+    int sequence = 0;
     length = housetuya_extract (payload, sizeof(payload), &(dev->secret),
                                 &code, &sequence, raw, length);
+    if (code == 0) return; // Not a valid message.
+
+    int request = 0;
+    if (housetuya_device_answered (device, code, sequence, &request)
+            == TUYA_CONTROL) {
+        // The held data points were delivered.
+        if (dev->batched && (request == dev->batchsequence))
+            housetuya_device_batch_clear (dev);
+
+        // Now is the time to send the latest command, if any.
+        if (dev->deferred && !housetuya_device_controlling (device)) {
+            dev->deferred = 0;
+            housetuya_device_control (device, dev->commanded);
+        }
+    }
+
+    if (code == TUYA_SESS_KEY_NEG_RESP) {
+        int sequence = housetuya_device_sequence (dev);
+        int size = housetuya_session_finish
+                       (dev->out + dev->outlength,
+                        sizeof(dev->out) - dev->outlength, &(dev->secret),
+                        sequence, payload, length);
+        if (size <= 0) {
+            houselog_trace (HOUSE_FAILURE, "PROTOCOL",
+                            "session negotiation with %s failed", dev->secret.id);
+            housetuya_device_fail (device, "invalid session");
+            return;
+        }
+        housetuya_device_enqueue (device, 0, sequence, size);
+        housetuya_device_flush (device);
+        housetuya_device_resume (device);
+        return;
+    }
     if (code == TUYA_CONTROL) return; // That's the device command response.
+    if (code == TUYA_CONTROL_NEW) return; // Same, protocol 3.4.
+    if (code == TUYA_HEARTBEAT) return; // Only needed to keep the link open.
     if (length <= 4) return;
 
-    // No matter what happens, we are done with this socket.
-    housetuya_device_close (device);
-
-    if ((code != TUYA_STATUS) && (code != TUYA_QUERY)) return;
+    if ((code != TUYA_STATUS) &&
+        (code != TUYA_QUERY) && (code != TUYA_QUERY_NEW)) return;
 
     // The STATUS response is a subset of the QUERY response. Both
-    // return the value of the control data point, which is the only
-    // item we actually care about here.
+    // return the value of the data points, which are all recorded. The
+    // control data point is the one that defines the device state.
+    // The device also sends STATUS messages on its own when its state
+    // changed for any reason.
 
     ParserToken json[256]; // Plan for devices with a lot of data points.
     int jsoncount = 256;
@@ -439,11 +1291,24 @@ static void housetuya_device_receive (int fd, int mode) {
         return;
     }
     free (input);
+    dev->last_status = dev->active;
+
+    // Protocol 3.4 devices embed the data points in a "data" object.
+    int dps = echttp_json_search (json, ".dps");
+    if (dps < 0) dps = echttp_json_search (json, ".data.dps");
+    if ((dps >= 0) && (json[dps].type == PARSER_OBJECT))
+        housetuya_device_dps_update (device, json + dps);
 
     char path[32];
     snprintf (path, sizeof(path), ".dps.%d", dev->control);
     int state = echttp_json_search (json, path);
     if (state < 0) {
+        snprintf (path, sizeof(path), ".data.dps.%d", dev->control);
+        state = echttp_json_search (json, path);
+    }
+    if (state < 0) {
+        // A STATUS message only lists the data points that changed.
+        if (code == TUYA_STATUS) return;
         houselog_trace (HOUSE_FAILURE, "PROTOCOL", "missing item %s", path);
         return;
     }
@@ -455,7 +1320,60 @@ static void housetuya_device_receive (int fd, int mode) {
     housetuya_device_status_update (device, json[state].value.bool);
 }
 
-static void housetuya_device_send (int fd, int mode) {
+static void housetuya_device_receive (int fd, int mode) {
+
+    int device = housetuya_device_socket_search (fd);
+    if (device < 0) {
+        echttp_forget (fd);
+        close (fd);
+        return;
+    }
+    struct DeviceMap *dev = Devices + device;
+    int length = read (fd, dev->in + dev->inlength,
+                       sizeof(dev->in) - dev->inlength);
+    if (length <= 0) {
+        // The device closed the connection, or the link is dead.
+        // This is not a failure: a new connection will be opened on demand.
+        housetuya_device_close (device);
+        return;
+    }
+    if (echttp_isdebug())
+        houselog_trace (HOUSE_INFO, "PROTOCOL", "received from %s (%d bytes): %s", dev->secret.id, length, housetuya_hexdump(dev->in + dev->inlength, length));
+
+    // Any data from the device shows that the link is alive.
+    dev->backoff = 0;
+    dev->active = time(0);
+
+    // A read may return several messages, or only a portion of a message.
+    // Process each complete message in place, and keep any trailing
+    // partial message until the rest of it has been received.
+    //
+    dev->inlength += length;
+    int cursor = 0;
+    while (cursor < dev->inlength) {
+        int size = housetuya_frame (dev->in + cursor, dev->inlength - cursor);
+        if (size == 0) break; // Wait for more data.
+        if (size < 0) {
+            cursor -= size; // Skip data that does not belong to a message.
+            continue;
+        }
+        housetuya_device_process (device, dev->in + cursor, size);
+        if (dev->socket != fd) return; // The link was closed meanwhile.
+        cursor += size;
+    }
+    if (cursor >= dev->inlength) {
+        dev->inlength = 0;
+    } else if (cursor > 0) {
+        dev->inlength -= cursor;
+        memmove (dev->in, dev->in + cursor, dev->inlength);
+    } else if (dev->inlength >= sizeof(dev->in)) {
+        houselog_trace (HOUSE_FAILURE, "PROTOCOL",
+                        "message from %s too large", dev->secret.id);
+        dev->inlength = 0;
+    }
+}
+
+static void housetuya_device_connected (int fd, int mode) {
 
     int device = housetuya_device_socket_search (fd);
     if (device < 0) {
@@ -463,12 +1381,54 @@ static void housetuya_device_send (int fd, int mode) {
         close (fd);
         return;
     }
-    if (Devices[device].outlength > 0) {
-        write (fd, Devices[device].out, Devices[device].outlength);
-        Devices[device].outlength = 0;
+    int error = 0;
+    socklen_t errorlength = sizeof(error);
+    if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &errorlength) < 0)
+        error = errno;
+    if (error) {
+        housetuya_device_fail (device, strerror(error));
+        return;
     }
+    Devices[device].linked = 1;
     echttp_listen (fd, 1, housetuya_device_receive, 0);
-    return;
+
+    // Protocol 3.4 devices require a session key for this connection.
+    // In that case the pending request is sent after the negotiation.
+    //
+    struct DeviceMap *dev = Devices + device;
+    if (!housetuya_session_ready (&(dev->secret))) {
+        int sequence = housetuya_device_sequence (dev);
+        housetuya_device_enqueue
+            (device, TUYA_SESS_KEY_NEG_START, sequence,
+             housetuya_session_start (dev->out + dev->outlength,
+                                      sizeof(dev->out) - dev->outlength,
+                                      &(dev->secret), sequence));
+    } else if (dev->batched && (!dev->batchsequence)) {
+        housetuya_device_batch (device); // Held while not connected.
+    }
+    housetuya_device_flush (device);
+}
+
+// Make sure that a connection to the device exists or is in progress.
+// The connection is kept open for as long as the device accepts it,
+// and is reused for all subsequent queries and controls.
+//
+static int housetuya_device_connect (int device) {
+
+    struct DeviceMap *dev = Devices + device;
+
+    if (dev->socket >= 0) return 1;
+    if (time(0) < dev->reconnect) return 0;
+
+    dev->socket = echttp_connect (dev->host, TuyaTcpPort);
+    if (dev->socket < 0) {
+        housetuya_device_fail (device, "cannot connect");
+        return 0;
+    }
+    housetuya_device_socket_index (dev->socket, device);
+    dev->linked = 0;
+    echttp_listen (dev->socket, 2, housetuya_device_connected, 0);
+    return 1;
 }
 
 static struct DeviceMap *housetuya_device_preamble (int device) {
@@ -479,38 +1439,96 @@ static struct DeviceMap *housetuya_device_preamble (int device) {
         dev->control = housetuya_model_get_control (dev->model);
         if (dev->control <= 0) return 0;
     }
-    housetuya_device_close (device); // Cleanup.
-    dev->socket = echttp_connect (dev->host, TuyaTcpPort);
-    if (dev->socket < 0) return 0;
+    if (!housetuya_device_connect (device)) return 0;
     return dev;
 }
 
 static void housetuya_device_sense (int device) {
     struct DeviceMap *dev = housetuya_device_preamble (device);
     if (!dev) return;
-    dev->outlength =
-        housetuya_query (dev->out, sizeof(dev->out), &(dev->secret), 0);
+    if (!housetuya_session_ready (&(dev->secret))) return; // Will resume.
+    int sequence = housetuya_device_sequence (dev);
+    char *frame = dev->out + dev->outlength;
+    int length = housetuya_query (frame, sizeof(dev->out) - dev->outlength,
+                                  &(dev->secret), sequence);
     if (echttp_isdebug())
-        houselog_trace (HOUSE_INFO, "PROTOCOL", "Sending QUERY to %s (%d bytes): %s", dev->secret.id, dev->outlength, housetuya_hexdump(dev->out, dev->outlength));
-    echttp_listen (dev->socket, 2, housetuya_device_send, 0);
+        houselog_trace (HOUSE_INFO, "PROTOCOL", "Sending QUERY %d to %s (%d bytes): %s", sequence, dev->secret.id, length, housetuya_hexdump(frame, length));
+    if (housetuya_device_enqueue (device, TUYA_QUERY, sequence, length))
+        housetuya_device_flush (device);
 }
 
 static void housetuya_device_control (int device, int state) {
     struct DeviceMap *dev = housetuya_device_preamble (device);
     if (!dev) return;
-    dev->outlength =
-        housetuya_control (dev->out, sizeof(dev->out), &(dev->secret), 0, dev->control, state);
+    if (!housetuya_session_ready (&(dev->secret))) return; // Will resume.
+    int sequence = housetuya_device_sequence (dev);
+    char *frame = dev->out + dev->outlength;
+    int length = housetuya_control (frame, sizeof(dev->out) - dev->outlength,
+                                    &(dev->secret), sequence, dev->control, state);
+    if (echttp_isdebug())
+        houselog_trace (HOUSE_INFO, "PROTOCOL", "Sending CONTROL %d (%d) to %s (%d bytes): %s", state, sequence, dev->secret.id, length, housetuya_hexdump(frame, length));
+    if (housetuya_device_enqueue (device, TUYA_CONTROL, sequence, length))
+        housetuya_device_flush (device);
+}
+
+// Send the data points set for this device, if the link is ready. The
+// batch is kept until the device answers, so that it can be sent again
+// on a new connection, or by a retry.
+//
+static void housetuya_device_batch (int device) {
+    struct DeviceMap *dev = housetuya_device_preamble (device);
+    if (!dev) return;
+    if (!housetuya_session_ready (&(dev->secret))) return; // Will resume.
+
+    int sequence = housetuya_device_sequence (dev);
+    char *frame = dev->out + dev->outlength;
+    int length = housetuya_control_dps (frame, sizeof(dev->out) - dev->outlength,
+                                        &(dev->secret), sequence,
+                                        dev->batch, dev->batched);
     if (echttp_isdebug())
-        houselog_trace (HOUSE_INFO, "PROTOCOL", "Sending CONTROL %d to %s (%d bytes): %s", state, dev->secret.id, dev->outlength, housetuya_hexdump(dev->out, dev->outlength));
-    echttp_listen (dev->socket, 2, housetuya_device_send, 0);
+        houselog_trace (HOUSE_INFO, "PROTOCOL", "Sending CONTROL of %d data points (%d) to %s (%d bytes): %s", dev->batched, sequence, dev->secret.id, length, housetuya_hexdump(frame, length));
+    if (housetuya_device_enqueue (device, TUYA_CONTROL, sequence, length)) {
+        dev->batchsequence = sequence;
+        housetuya_device_flush (device);
+    }
+}
+
+// Issue the request that was held while the session key was negotiated.
+// A new session is also a good time to refresh the device state.
+//
+static void housetuya_device_resume (int device) {
+    struct DeviceMap *dev = Devices + device;
+    if (dev->batched)
+        housetuya_device_batch (device);
+    else if (dev->pending && (dev->status != dev->commanded))
+        housetuya_device_control (device, dev->commanded);
+    else
+        housetuya_device_sense (device);
+}
+
+// Keep an idle link open, so that the next control does not have to wait
+// for a new connection. Links that are busy or not established are left
+// alone: there is no point sending a heartbeat there.
+//
+static void housetuya_device_heartbeat (int device, time_t now) {
+    struct DeviceMap *dev = Devices + device;
+    if ((!dev->linked) || dev->inflight || (dev->outlength > 0)) return;
+    if (!housetuya_session_ready (&(dev->secret))) return;
+    if (now < dev->active + TuyaHeartbeatPeriod) return;
+    int sequence = housetuya_device_sequence (dev);
+    housetuya_device_enqueue
+        (device, TUYA_HEARTBEAT, sequence,
+         housetuya_heartbeat (dev->out, sizeof(dev->out), &(dev->secret), sequence));
+    housetuya_device_flush (device);
 }
 
 int housetuya_device_set (int device, int state, int pulse) {
 
     const char *namedstate = state?"on":"off";
     time_t now = time(0);
+    long long clock = housetuya_device_clock();
 
-    if (device < 0 || device > DevicesCount) return 0;
+    if (device < 0 || device >= DevicesCount) return 0;
 
     if (echttp_isdebug()) {
         if (pulse) fprintf (stderr, "set %s to %s at %ld (pulse %ds)\n", Devices[device].name, namedstate, now, pulse);
@@ -519,71 +1537,213 @@ int housetuya_device_set (int device, int state, int pulse) {
 
     if (pulse > 0) {
         Devices[device].deadline = now + pulse;
+        Devices[device].pulse_end = clock + (pulse * 1000LL);
         houselog_event ("DEVICE", Devices[device].name, "SET",
                         "%s FOR %d SECONDS", namedstate, pulse);
     } else {
         Devices[device].deadline = 0;
+        Devices[device].pulse_end = 0;
         houselog_event ("DEVICE", Devices[device].name, "SET", "%s", namedstate);
     }
     Devices[device].commanded = state;
-    if (Devices[device].pending) return 1; // Don't overstep.
     Devices[device].pending = now + 10;
+    housetuya_device_touch (device);
+    housetuya_device_batch_clear (Devices + device); // Superseded.
 
     // Only send a command if we detected the device on the network.
+    // If the device has not answered the previous command yet, keep only
+    // the latest state: it will be sent when the answer comes.
     //
     if (Devices[device].detected) {
-        housetuya_device_control (device, state);
+        if (housetuya_device_controlling (device)) {
+            if (Devices[device].deferred) {
+                Devices[device].collapsed += 1; // Touched above.
+                if (echttp_isdebug())
+                    fprintf (stderr, "collapsed command to %s (%d so far)\n",
+                             Devices[device].name, Devices[device].collapsed);
+            }
+            Devices[device].deferred = 1;
+        } else {
+            Devices[device].deferred = 0;
+            housetuya_device_control (device, state);
+        }
     }
+    Devices[device].retry = clock + TuyaRetryDelay;
+    housetuya_device_reschedule (device); // Pulse end, retry.
     return 0;
 }
 
-void housetuya_device_periodic (time_t now) {
+int housetuya_device_set_dps (int device, const TuyaDataPoint *dps, int count) {
 
-    static time_t LastRetry = 0;
+    time_t now = time(0);
+    int state = -1;
+    int i;
 
-    if (now < LastRetry + 5) return;
-    LastRetry = now;
+    if (device < 0 || device >= DevicesCount) return 0;
+    if ((count <= 0) || (count > TUYA_MAX_BATCH)) return -1;
 
-    int i;
-    for (i = 0; i < DevicesCount; ++i) {
+    struct DeviceMap *dev = Devices + device;
+    if (dev->control <= 0) dev->control = housetuya_model_get_control (dev->model);
 
-        if (now >= Devices[i].last_sense + 35) {
-            if ((!Devices[i].pending) && (Devices[i].ipaddress != 0)) {
-                housetuya_device_close (i); // Cleanup, if ever.
-                housetuya_device_sense (i);
-            }
-            Devices[i].last_sense = now;
-        }
+    if (dev->batched) {
+        dev->collapsed += 1;
+        housetuya_device_batch_clear (dev);
+        housetuya_device_touch (device);
+    }
+    for (i = 0; i < count; ++i) {
+        dev->batch[i] = dps[i];
+        if (dps[i].type == TUYA_DPS_STRING)
+            dev->batch[i].value.string = strdup (dps[i].value.string);
+        else if ((dps[i].id == dev->control) && (dps[i].type == TUYA_DPS_BOOL))
+            state = dps[i].value.bool;
+    }
+    dev->batched = count;
+    dev->batchexpires = now + 10;
+
+    if (state >= 0) {
+        if (echttp_isdebug())
+            fprintf (stderr, "set %s to %s at %ld\n",
+                     dev->name, state?"on":"off", now);
+        houselog_event ("DEVICE", dev->name, "SET",
+                        "%s WITH %d DATA POINTS", state?"on":"off", count);
+        dev->deadline = 0;
+        dev->pulse_end = 0;
+        dev->commanded = state;
+        dev->pending = now + 10;
+        housetuya_device_touch (device);
+        dev->deferred = 0; // Superseded by this request.
+        dev->retry = housetuya_device_clock() + TuyaRetryDelay;
+        housetuya_device_reschedule (device);
+    } else {
+        houselog_event ("DEVICE", dev->name, "SET", "%d DATA POINTS", count);
+    }
 
-        // If we did not detect a device for 3 senses, consider it failed.
-        if (Devices[i].detected > 0 && Devices[i].detected < now - 100) {
-            houselog_event ("DEVICE", Devices[i].name, "SILENT",
-                            "ADDRESS %s", Devices[i].host);
-            housetuya_device_close (i);
-            housetuya_device_reset (i, 0);
-            Devices[i].detected = 0;
+    if (dev->detected) housetuya_device_batch (device);
+    return 1;
+}
+
+static void housetuya_device_check (int i, time_t now, long long clock) {
+
+    // A device that does not respond to a request is considered
+    // unreachable: reset the link and let the next request reconnect.
+    if (Devices[i].waiting && now > Devices[i].waiting + TuyaResponseTimeout) {
+        housetuya_device_fail (i, "no response");
+    }
+    housetuya_device_heartbeat (i, now);
+
+    // Data points that could not be sent yet (no connection, or device
+    // not detected) are sent as soon as possible, unless too late.
+    if (Devices[i].batched) {
+        if (now >= Devices[i].batchexpires) {
+            if (echttp_isdebug())
+                fprintf (stderr, "data points for %s expired\n", Devices[i].name);
+            housetuya_device_batch_clear (Devices + i);
+        } else if ((!Devices[i].batchsequence) && Devices[i].detected) {
+            housetuya_device_batch (i);
+            Devices[i].retry = clock + TuyaRetryDelay; // Just sent.
         }
+    }
 
-        if (Devices[i].deadline > 0 && now >= Devices[i].deadline) {
-            houselog_event ("DEVICE", Devices[i].name, "RESET", "END OF PULSE");
-            Devices[i].commanded = 0;
-            Devices[i].pending = now + 5;
-            Devices[i].deadline = 0;
+    if (now >= Devices[i].next_sense) {
+        if ((!Devices[i].pending) && (Devices[i].ipaddress != 0)) {
+            if ((!TuyaPushMode) || (!Devices[i].linked) ||
+                (now >= Devices[i].last_status + TuyaQuietPeriod))
+                housetuya_device_sense (i);
         }
-        if (Devices[i].status != Devices[i].commanded) {
-            if (Devices[i].pending > now) {
+        housetuya_device_plan_sense (i, now);
+    }
+
+    // If we did not detect a device for 3 senses, consider it failed.
+    if (Devices[i].detected > 0 &&
+        Devices[i].detected < now - TuyaSilentPeriod) {
+        houselog_event ("DEVICE", Devices[i].name, "SILENT",
+                        "ADDRESS %s", Devices[i].host);
+        housetuya_device_close (i);
+        housetuya_device_reset (i, 0);
+        Devices[i].detected = 0;
+        housetuya_device_record (i, "SILENT");
+    }
+
+    if (Devices[i].pulse_end && clock >= Devices[i].pulse_end) {
+        houselog_event ("DEVICE", Devices[i].name, "RESET", "END OF PULSE");
+        housetuya_device_batch_clear (Devices + i);
+        Devices[i].commanded = 0;
+        Devices[i].pending = now + TuyaRetryPeriod;
+        Devices[i].deadline = 0;
+        housetuya_device_touch (i);
+        Devices[i].pulse_end = 0;
+        Devices[i].retry = 0; // Send now.
+    }
+    if (Devices[i].status != Devices[i].commanded) {
+        if (Devices[i].pending > now) {
+            // Do not send another CONTROL while the latest one is still
+            // expected to be answered: its answer sends the deferred
+            // command, if any, so that the commands remain coalesced.
+            long long overdue = Devices[i].controlled + TuyaRetryDelay;
+            if ((clock >= Devices[i].retry) &&
+                housetuya_device_controlling (i) && (clock < overdue)) {
+                Devices[i].retry = overdue;
+            } else if (clock >= Devices[i].retry) {
                 if (Devices[i].detected) {
                     const char *state = Devices[i].commanded?"on":"off";
                     houselog_event ("DEVICE", Devices[i].name, "RETRY", state);
-                    housetuya_device_control (i, Devices[i].commanded);
+                    if (Devices[i].batched)
+                        housetuya_device_batch (i); // All data points.
+                    else
+                        housetuya_device_control (i, Devices[i].commanded);
                 }
-            } else if (Devices[i].pending) {
-                houselog_event ("DEVICE", Devices[i].name, "TIMEOUT", "");
-                housetuya_device_close (i);
-                housetuya_device_reset (i, Devices[i].status);
+                Devices[i].retry = clock + TuyaRetryDelay;
+            }
+        } else if (Devices[i].pending) {
+            houselog_event ("DEVICE", Devices[i].name, "TIMEOUT", "");
+            housetuya_device_close (i);
+            housetuya_device_reset (i, Devices[i].status);
+        }
+    }
+}
+
+static void housetuya_device_run (void) {
+
+    // Only the devices that are due are checked. Since each device has
+    // its own due time, the queries are spread over the sense period
+    // instead of being sent all at once.
+    time_t now = time(0);
+    long long clock = housetuya_device_clock();
+    int i;
+    while ((i = housetuya_device_queue_pop (clock)) >= 0) {
+        housetuya_device_check (i, now, clock);
+        housetuya_device_schedule (i, housetuya_device_next_check (i, now, clock));
+    }
+    if (DevicesQueueFailed) {
+        int left = 0;
+        for (i = 0; i < DevicesCount; ++i) {
+            struct DeviceMap *dev = Devices + i;
+            if (dev->queued != TUYA_UNQUEUED) continue;
+            long long due = dev->due;
+            if (due <= clock) {
+                dev->queued = -1;
+                housetuya_device_check (i, now, clock);
+                due = housetuya_device_next_check (i, now, clock);
             }
+            housetuya_device_schedule (i, due);
+            if (dev->queued < 0) left += 1;
         }
+        if (!left) DevicesQueueFailed = 0;
+    }
+    housetuya_device_arm ();
+}
+
+static void housetuya_device_timer (int fd, int mode) {
+    unsigned long long expired;
+    if (read (fd, &expired, sizeof(expired)) < 0) {
+        if (errno == EAGAIN) return; // Spurious wakeup.
     }
+    TuyaTimerArmed = 0; // One shot: the timer is no longer armed.
+    housetuya_device_run ();
+}
+
+void housetuya_device_periodic (time_t now) {
+    housetuya_device_run ();
 }
 
 // ******* CONFIGURATION
@@ -611,6 +1771,7 @@ const char *housetuya_device_refresh (void) {
     }
 
     int i;
+    int renamed = 0;
     for (i = 0; i < count; ++i) {
         int device = houseconfig_array_object (devices, i);
         if (device <= 0) continue;
@@ -622,41 +1783,64 @@ const char *housetuya_device_refresh (void) {
         if (idx < 0) {
             idx = housetuya_device_add (name, id, model);
         } else {
-            housetuya_device_refresh_string (&(Devices[idx].name), name);
+            if (housetuya_device_refresh_string (&(Devices[idx].name), name)) {
+                housetuya_device_touch (idx); // The name is in the status.
+                renamed = 1;
+            }
+        }
+        if (housetuya_device_refresh_string (&(Devices[idx].secret.key),
+                                             houseconfig_string (device, ".key"))) {
+            housetuya_device_close (idx); // The link used the old key.
+            housetuya_forget (&(Devices[idx].secret));
         }
-        housetuya_device_refresh_string (&(Devices[idx].secret.key),
-                                         houseconfig_string (device, ".key"));
         housetuya_device_refresh_string (&(Devices[idx].description),
                                          houseconfig_string (device, ".description"));
         if (echttp_isdebug()) fprintf (stderr, "load device %s, ID %s%s\n", Devices[idx].name, Devices[idx].secret.id);
         housetuya_device_reset (idx, Devices[idx].status);
     }
+    if (renamed) housetuya_device_reindex ();
     return 0;
 }
 
-void housetuya_device_live_config (ParserContext context, int top) {
+void housetuya_device_live_config (TuyaJson *json) {
 
-    int items = echttp_json_add_array (context, top, "devices");
+    housetuya_json_array (json, "devices");
 
     int i;
     for (i = 0; i < DevicesCount; ++i) {
-        int device = echttp_json_add_object (context, items, 0);
+        housetuya_json_object (json, 0);
         if (Devices[i].name && Devices[i].name[0])
-            echttp_json_add_string (context, device, "name", Devices[i].name);
+            housetuya_json_string (json, "name", Devices[i].name);
         if (Devices[i].secret.id && Devices[i].secret.id[0])
-            echttp_json_add_string (context, device, "id", Devices[i].secret.id);
+            housetuya_json_string (json, "id", Devices[i].secret.id);
         if (Devices[i].model && Devices[i].model[0])
-            echttp_json_add_string (context, device, "model", Devices[i].model);
+            housetuya_json_string (json, "model", Devices[i].model);
         if (Devices[i].host && Devices[i].host[0])
-            echttp_json_add_string (context, device, "host", Devices[i].host);
+            housetuya_json_string (json, "host", Devices[i].host);
         if (Devices[i].secret.key && Devices[i].secret.key[0])
-            echttp_json_add_string (context, device, "key", Devices[i].secret.key);
+            housetuya_json_string (json, "key", Devices[i].secret.key);
         if (Devices[i].description && Devices[i].description[0])
-            echttp_json_add_string (context, device, "description", Devices[i].description);
+            housetuya_json_string (json, "description", Devices[i].description);
+        housetuya_json_end (json);
     }
+    housetuya_json_end (json);
 }
 
 const char *housetuya_device_initialize (int argc, const char **argv) {
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-push", argv[i])) TuyaPushMode = 1;
+    }
+    srandom ((unsigned int)time(0) ^ (unsigned int)getpid());
+
+    TuyaTimer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (TuyaTimer >= 0) {
+        echttp_listen (TuyaTimer, 1, housetuya_device_timer, 0);
+        housetuya_device_arm ();
+    } else {
+        houselog_trace (HOUSE_FAILURE, "TIMER",
+                        "Cannot create timer: %s", strerror(errno));
+    }
     housetuya_device_discovery_sockets ();
     return 0;
 }
@@ -28,15 +28,30 @@ int housetuya_device_changed (void);
 
 int housetuya_device_count (void);
 const char *housetuya_device_name (int point);
+int housetuya_device_search (const char *name);
+int housetuya_device_search_next (const char *name, int point);
 
-void housetuya_device_live_config (ParserContext context, int top);
+void housetuya_device_live_config (TuyaJson *json);
 
 const char *housetuya_device_failure (int point);
 
 int    housetuya_device_commanded (int point);
 time_t housetuya_device_deadline  (int point);
+int    housetuya_device_interval  (int point);
+int    housetuya_device_collapsed (int point);
 int    housetuya_device_get       (int point);
+long long housetuya_device_generation (void);
+long long housetuya_device_updated (int point);
+
+long long housetuya_device_latest (void);
+long long housetuya_device_oldest (void);
+int housetuya_device_change (long long id, time_t *timestamp,
+                             const char **action, const char **state);
+
+const char *housetuya_device_dps  (int point, int index,
+                                   TuyaDataPoint *value, time_t *updated);
 int    housetuya_device_set       (int point, int state, int pulse);
+int    housetuya_device_set_dps   (int point, const TuyaDataPoint *dps, int count);
 
 void housetuya_device_periodic (time_t now);
 
@@ -0,0 +1,410 @@
+/* HouseTuya - A simple web service for control of Tuya Devices
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housetuya_events.c - Report the device state changes to web clients.
+ *
+ * The changes are rendered by the /tuya/events route of the web server,
+ * which returns immediately since echttp always responds to a request
+ * before processing the next one. This module also serves the same URI
+ * on a separate port, where the request is held open until a change
+ * occurs, or until the wait delay expires (long poll):
+ *
+ *    GET /tuya/events?since=<ID>&wait=<SECONDS>
+ *
+ * Only this request is supported on that port, and each connection
+ * carries a single request.
+ *
+ * SYNOPSYS:
+ *
+ * int housetuya_events_initialize (int argc, const char **argv);
+ *
+ *    Open the long poll port. Return the port number, or 0 if the port
+ *    is disabled (-no-events-port option) or could not be opened. The
+ *    port is dynamic, unless the -events-port=<N> option is used.
+ *    Note that this port listens on all network interfaces, like the
+ *    web server itself.
+ *
+ * int housetuya_events_port (void);
+ *
+ *    Return the long poll port, or 0 if not available.
+ *
+ * const char *housetuya_events_render (long long since);
+ *
+ *    Return the JSON text listing the device state changes that occurred
+ *    after the change identified by since. The text remains valid until
+ *    the next call.
+ *
+ * void housetuya_events_periodic (time_t now);
+ *
+ *    Respond to the held requests for which a change occurred, or that
+ *    waited long enough. Close the connections that did not send their
+ *    request, or did not read the response, within 10 seconds.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <strings.h>
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "housetuya.h"
+#include "housetuya_json.h"
+#include "housetuya_messages.h"
+#include "housetuya_device.h"
+#include "housetuya_events.h"
+
+#define TUYA_EVENTS_CLIENTS 32
+#define TUYA_EVENTS_WAIT    60 // The longest a request is held, in seconds.
+#define TUYA_EVENTS_TIMEOUT 10 // To receive the request, or send the response.
+
+struct EventsClient {
+    int fd;             // -1 if this entry is not used.
+    int received;
+    char request[1024];
+    long long since;
+    int held;           // The request was received, waiting for a change.
+    time_t deadline;    // End of the receive, wait or send delay.
+    char *response;     // Not 0 once the response is being sent.
+    int length;
+    int sent;
+};
+
+static struct EventsClient EventsClients[TUYA_EVENTS_CLIENTS];
+
+static int EventsSocket = -1;
+static int EventsPort = 0;
+
+const char *housetuya_events_render (long long since) {
+
+    static TuyaJson json;
+    long long latest = housetuya_device_latest();
+    long long oldest = housetuya_device_oldest();
+    int reset = 0;
+
+    if (since > latest) {
+        since = 0; // The service restarted since the last request.
+        reset = 1;
+    }
+    if (since < oldest - 1) {
+        since = oldest - 1;
+        reset = 1;
+    }
+    housetuya_json_reset (&json);
+    housetuya_json_object (&json, 0);
+    housetuya_json_string (&json, "host", housetuya_host());
+    housetuya_json_integer (&json, "timestamp", (long long)time(0));
+    housetuya_json_object (&json, "events");
+    housetuya_json_integer (&json, "latest", latest);
+    housetuya_json_bool (&json, "reset", reset);
+    housetuya_json_array (&json, "changes");
+
+    long long id;
+    for (id = since + 1; id <= latest; ++id) {
+        time_t timestamp;
+        const char *action;
+        const char *state;
+        int device = housetuya_device_change (id, &timestamp, &action, &state);
+        if (device < 0) continue;
+
+        housetuya_json_object (&json, 0);
+        housetuya_json_integer (&json, "id", id);
+        housetuya_json_integer (&json, "time", (long long)timestamp);
+        housetuya_json_string (&json, "point", housetuya_device_name(device));
+        housetuya_json_string (&json, "action", action);
+        housetuya_json_string (&json, "state", state);
+        housetuya_json_end (&json);
+    }
+    housetuya_json_end (&json);
+    housetuya_json_end (&json);
+    housetuya_json_end (&json);
+
+    return housetuya_json_text (&json);
+}
+
+static struct EventsClient *housetuya_events_search (int fd) {
+    int i;
+    for (i = 0; i < TUYA_EVENTS_CLIENTS; ++i) {
+        if (EventsClients[i].fd == fd) return EventsClients + i;
+    }
+    return 0;
+}
+
+static void housetuya_events_close (struct EventsClient *client) {
+    echttp_forget (client->fd);
+    close (client->fd);
+    client->fd = -1;
+    if (client->response) free (client->response);
+    client->response = 0;
+}
+
+static void housetuya_events_send (int fd, int mode) {
+
+    struct EventsClient *client = housetuya_events_search (fd);
+    if (!client) {
+        echttp_forget (fd);
+        close (fd);
+        return;
+    }
+    int length = write (fd, client->response + client->sent,
+                        client->length - client->sent);
+    if (length <= 0) {
+        housetuya_events_close (client);
+        return;
+    }
+    client->sent += length;
+    if (client->sent >= client->length) housetuya_events_close (client);
+}
+
+// Return the value of the named HTTP header, if present in the request.
+//
+static int housetuya_events_header (const char *request, const char *name,
+                                    char *value, int size) {
+    const char *cursor = request;
+    int namelength = strlen(name);
+
+    while ((cursor = strstr (cursor, "\r\n")) != 0) {
+        cursor += 2;
+        if (strncasecmp (cursor, name, namelength)) continue;
+        if (cursor[namelength] != ':') continue;
+        cursor += namelength + 1;
+        while (*cursor == ' ') cursor += 1;
+        int length = strcspn (cursor, "\r\n");
+        if (length >= size) return 0;
+        memcpy (value, cursor, length);
+        value[length] = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Only a page from the same host is allowed to read the response, since
+// this port does not go through the CORS protection of the web server.
+// The port is ignored: the page comes from the web server's own port.
+//
+static int housetuya_events_same_host (const char *origin, const char *host) {
+    const char *scheme = strstr (origin, "://");
+    if (scheme) origin = scheme + 3;
+    int length = strcspn (origin, ":/");
+    return (strcspn (host, ":") == length) && (!strncmp (origin, host, length));
+}
+
+static void housetuya_events_respond (struct EventsClient *client,
+                                      const char *status, const char *text) {
+
+    char origin[256];
+    char host[256];
+    char allow[300];
+
+    allow[0] = 0;
+    if (housetuya_events_header (client->request, "Origin", origin, sizeof(origin)) &&
+        housetuya_events_header (client->request, "Host", host, sizeof(host)) &&
+        housetuya_events_same_host (origin, host)) {
+        snprintf (allow, sizeof(allow),
+                  "Access-Control-Allow-Origin: %s\r\n", origin);
+    }
+    if (!text) text = "";
+    int textlength = strlen(text);
+    int size = textlength + 512;
+
+    client->response = malloc (size);
+    if (!client->response) {
+        housetuya_events_close (client);
+        return;
+    }
+    client->length =
+        snprintf (client->response, size,
+                  "HTTP/1.1 %s\r\n"
+                  "Content-Type: application/json\r\n"
+                  "Content-Length: %d\r\n"
+                  "Cache-Control: no-store\r\n"
+                  "%s"
+                  "Connection: close\r\n\r\n%s",
+                  status, textlength, allow, text);
+    client->sent = 0;
+    client->held = 0;
+    client->deadline = time(0) + TUYA_EVENTS_TIMEOUT;
+    echttp_listen (client->fd, 2, housetuya_events_send, 0);
+}
+
+static long long housetuya_events_parameter (const char *query,
+                                             const char *name) {
+    int length = strlen(name);
+    while (query) {
+        query += 1; // Skip the '?' or '&'.
+        if ((!strncmp (query, name, length)) && (query[length] == '='))
+            return atoll (query + length + 1);
+        query = strchr (query, '&');
+    }
+    return 0;
+}
+
+static void housetuya_events_request (struct EventsClient *client) {
+
+    static const char uri[] = "/tuya/events";
+
+    // Only the request line is decoded: GET <uri>[?<parameters>] HTTP/1.x
+    //
+    if (strncmp (client->request, "GET ", 4) ||
+        strncmp (client->request + 4, uri, sizeof(uri) - 1)) {
+        housetuya_events_respond (client, "404 Not Found", 0);
+        return;
+    }
+    char *query = client->request + 4 + sizeof(uri) - 1;
+    char *end = query + strcspn (query, " \r\n");
+    if ((*query != '?') && (query != end)) {
+        housetuya_events_respond (client, "404 Not Found", 0);
+        return;
+    }
+    char saved = *end;
+    *end = 0; // Temporarily, to limit the search to the query.
+    long long wait = housetuya_events_parameter (query, "wait");
+    client->since = housetuya_events_parameter (query, "since");
+    *end = saved;
+
+    if (wait > TUYA_EVENTS_WAIT) wait = TUYA_EVENTS_WAIT;
+    if ((wait <= 0) || (client->since != housetuya_device_latest())) {
+        housetuya_events_respond
+            (client, "200 OK", housetuya_events_render (client->since));
+        return;
+    }
+    client->held = 1; // Until a change occurs.
+    client->deadline = time(0) + wait;
+}
+
+static void housetuya_events_receive (int fd, int mode) {
+
+    struct EventsClient *client = housetuya_events_search (fd);
+    if (!client) {
+        echttp_forget (fd);
+        close (fd);
+        return;
+    }
+    int length = read (fd, client->request + client->received,
+                       sizeof(client->request) - client->received - 1);
+    if (length <= 0) {
+        housetuya_events_close (client); // The client gave up.
+        return;
+    }
+    if (client->held || client->response) return; // Already received.
+
+    client->received += length;
+    client->request[client->received] = 0;
+    if (strstr (client->request, "\r\n\r\n")) {
+        housetuya_events_request (client);
+    } else if (client->received >= sizeof(client->request) - 1) {
+        housetuya_events_respond (client, "431 Request Header Fields Too Large", 0);
+    }
+}
+
+static void housetuya_events_accept (int fd, int mode) {
+
+    int i;
+    int client = accept (fd, 0, 0);
+    if (client < 0) return;
+
+    for (i = 0; i < TUYA_EVENTS_CLIENTS; ++i) {
+        if (EventsClients[i].fd < 0) break;
+    }
+    if (i >= TUYA_EVENTS_CLIENTS) {
+        houselog_trace (HOUSE_FAILURE, "EVENTS", "too many clients");
+        close (client);
+        return;
+    }
+    EventsClients[i].fd = client;
+    EventsClients[i].received = 0;
+    EventsClients[i].since = 0;
+    EventsClients[i].held = 0;
+    EventsClients[i].deadline = time(0) + TUYA_EVENTS_TIMEOUT;
+    EventsClients[i].response = 0;
+    echttp_listen (client, 1, housetuya_events_receive, 0);
+}
+
+int housetuya_events_initialize (int argc, const char **argv) {
+
+    const char *portp = 0;
+    struct sockaddr_in addr;
+    socklen_t addrlength = sizeof(addr);
+    int i;
+
+    for (i = 0; i < TUYA_EVENTS_CLIENTS; ++i) EventsClients[i].fd = -1;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-no-events-port", argv[i])) return 0;
+        echttp_option_match ("-events-port=", argv[i], &portp);
+    }
+
+    EventsSocket = socket (AF_INET, SOCK_STREAM, 0);
+    if (EventsSocket < 0) {
+        houselog_trace (HOUSE_FAILURE, "EVENTS", "socket: %s", strerror(errno));
+        return 0;
+    }
+    int value = 1;
+    setsockopt (EventsSocket, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+
+    memset (&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons (portp ? atoi(portp) : 0);
+    if ((bind (EventsSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen (EventsSocket, 8) < 0) ||
+        (getsockname (EventsSocket, (struct sockaddr *)&addr, &addrlength) < 0)) {
+        houselog_trace (HOUSE_FAILURE, "EVENTS", "port: %s", strerror(errno));
+        close (EventsSocket);
+        EventsSocket = -1;
+        return 0;
+    }
+    EventsPort = ntohs (addr.sin_port);
+    echttp_listen (EventsSocket, 1, housetuya_events_accept, 1);
+    return EventsPort;
+}
+
+int housetuya_events_port (void) {
+    return EventsPort;
+}
+
+void housetuya_events_periodic (time_t now) {
+
+    int i;
+    long long latest = housetuya_device_latest();
+
+    for (i = 0; i < TUYA_EVENTS_CLIENTS; ++i) {
+        struct EventsClient *client = EventsClients + i;
+        if (client->fd < 0) continue;
+        if ((!client->held) || client->response) {
+            // A client that does not send its request, or does not read
+            // the response, would otherwise keep its entry forever and
+            // lock out the other clients.
+            if (now >= client->deadline) housetuya_events_close (client);
+            continue;
+        }
+        if ((client->since == latest) && (now < client->deadline)) continue;
+        housetuya_events_respond
+            (client, "200 OK", housetuya_events_render (client->since));
+    }
+}
@@ -0,0 +1,28 @@
+/* HouseTuya - A simple home web server for control of Tuya Devices
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housetuya_events.h - Report the device state changes to web clients.
+ */
+int housetuya_events_initialize (int argc, const char **argv);
+int housetuya_events_port (void);
+
+const char *housetuya_events_render (long long since);
+
+void housetuya_events_periodic (time_t now);
@@ -0,0 +1,178 @@
+/* HouseTuya - A simple web service for control of Tuya Devices
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housetuya_hash.c - Hash functions and hash indexes.
+ *
+ * SYNOPSYS:
+ *
+ * unsigned int housetuya_hash (const char *key);
+ *
+ *    Return the FNV-1a hash of a string.
+ *
+ * unsigned int housetuya_hash_nocase (const char *key);
+ *
+ *    Same as housetuya_hash(), but ignore the case of ASCII letters, for
+ *    indexes searched using strcasecmp().
+ *
+ * unsigned int housetuya_hash_data (unsigned int seed,
+ *                                   const char *data, int length);
+ *
+ *    Return the FNV-1a hash of binary data. The seed is mixed in the
+ *    initial value, so that the same data from different sources (for
+ *    example different IP addresses) hashes differently.
+ *
+ * unsigned int housetuya_hash_mix (unsigned int hash, unsigned int seed);
+ *
+ *    Derive a new, well distributed, hash value from an existing hash and
+ *    a seed. This is used for the second level of the perfect hash tables
+ *    generated at build time (see tuyacatalog.c).
+ *
+ * void housetuya_hash_clear (TuyaHashIndex *index, int capacity);
+ *
+ *    Empty the index and size it for items 0 to capacity-1. The items
+ *    themselves (and their keys) are stored by the caller, typically in
+ *    an array: the index only links the item numbers. Adding an item
+ *    beyond the capacity extends it, but a full rebuild keeps the buckets
+ *    proportional to the number of items.
+ *
+ * void housetuya_hash_free (TuyaHashIndex *index);
+ *
+ *    Release the memory used by the index, which is left empty.
+ *
+ * void housetuya_hash_add (TuyaHashIndex *index, unsigned int hash, int item);
+ *
+ *    Add an item to the index. An item must not be added twice.
+ *
+ * int housetuya_hash_first (const TuyaHashIndex *index, unsigned int hash);
+ * int housetuya_hash_next  (const TuyaHashIndex *index, int item);
+ *
+ *    Walk the list of items that might match the specified hash. The
+ *    caller must compare the actual keys. Return -1 at the end of the list.
+ *    A typical search loop is:
+ *
+ *       for (i = housetuya_hash_first (&index, housetuya_hash (key));
+ *            i >= 0; i = housetuya_hash_next (&index, i)) {
+ *           if (!strcmp (key, Items[i].name)) return i;
+ *       }
+ *       return -1;
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "housetuya_hash.h"
+
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+unsigned int housetuya_hash (const char *key) {
+    unsigned int hash = FNV_BASIS;
+    while (*key) {
+        hash ^= (unsigned char)(*(key++));
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+unsigned int housetuya_hash_nocase (const char *key) {
+    unsigned int hash = FNV_BASIS;
+    while (*key) {
+        hash ^= (unsigned char)tolower(*(key++));
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+unsigned int housetuya_hash_data (unsigned int seed,
+                                  const char *data, int length) {
+    unsigned int hash = FNV_BASIS ^ seed;
+    int i;
+    for (i = 0; i < length; ++i) {
+        hash ^= (unsigned char)(data[i]);
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+unsigned int housetuya_hash_mix (unsigned int hash, unsigned int seed) {
+    // The MurmurHash3 32 bits finalizer.
+    hash ^= seed * 0x9e3779b9u;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+void housetuya_hash_clear (TuyaHashIndex *index, int capacity) {
+
+    int size = 16;
+    while (size < 2 * capacity) size *= 2;
+
+    if (size != index->size) {
+        index->bucket = realloc (index->bucket, size * sizeof(int));
+        index->size = index->bucket ? size : 0;
+    }
+    if (capacity > index->capacity) {
+        index->next = realloc (index->next, capacity * sizeof(int));
+        index->capacity = index->next ? capacity : 0;
+    }
+    if (index->bucket) memset (index->bucket, 0xff, index->size * sizeof(int));
+    if (index->next) memset (index->next, 0xff, index->capacity * sizeof(int));
+}
+
+void housetuya_hash_free (TuyaHashIndex *index) {
+    if (index->bucket) free (index->bucket);
+    if (index->next) free (index->next);
+    index->bucket = index->next = 0;
+    index->size = index->capacity = 0;
+}
+
+void housetuya_hash_add (TuyaHashIndex *index, unsigned int hash, int item) {
+
+    if (item >= index->capacity) {
+        int capacity = item + 16;
+        int *next = realloc (index->next, capacity * sizeof(int));
+        if (!next) return;
+        memset (next + index->capacity, 0xff,
+                (capacity - index->capacity) * sizeof(int));
+        index->next = next;
+        index->capacity = capacity;
+    }
+    if (!index->size) {
+        housetuya_hash_clear (index, index->capacity);
+        if (!index->size) return;
+    }
+    int slot = hash & (index->size - 1);
+    index->next[item] = index->bucket[slot];
+    index->bucket[slot] = item;
+}
+
+int housetuya_hash_first (const TuyaHashIndex *index, unsigned int hash) {
+    if (!index->size) return -1;
+    return index->bucket[hash & (index->size - 1)];
+}
+
+int housetuya_hash_next (const TuyaHashIndex *index, int item) {
+    if ((item < 0) || (item >= index->capacity)) return -1;
+    return index->next[item];
+}
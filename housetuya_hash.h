@@ -0,0 +1,41 @@
+/* HouseTuya - A simple home web server for control of Tuya Devices
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housetuya_hash.h - Hash functions and hash indexes.
+ */
+unsigned int housetuya_hash (const char *key);
+unsigned int housetuya_hash_nocase (const char *key);
+unsigned int housetuya_hash_data (unsigned int seed,
+                                  const char *data, int length);
+unsigned int housetuya_hash_mix (unsigned int hash, unsigned int seed);
+
+typedef struct {
+    int size;      // Number of buckets (a power of 2).
+    int *bucket;   // First item in each bucket, or -1.
+    int capacity;  // Number of items that can be indexed.
+    int *next;     // Next item in the same bucket, or -1.
+} TuyaHashIndex;
+
+void housetuya_hash_clear (TuyaHashIndex *index, int capacity);
+void housetuya_hash_free  (TuyaHashIndex *index);
+void housetuya_hash_add   (TuyaHashIndex *index, unsigned int hash, int item);
+int  housetuya_hash_first (const TuyaHashIndex *index, unsigned int hash);
+int  housetuya_hash_next  (const TuyaHashIndex *index, int item);
+
@@ -0,0 +1,237 @@
+/* HouseTuya - A simple web service for control of Tuya Devices
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housetuya_json.c - A simple streaming JSON writer.
+ *
+ * This writes JSON text directly into a buffer that grows as needed,
+ * without building a token tree first. The buffer is kept from one use
+ * to the next, so that a document rebuilt periodically does not cause
+ * repeated memory allocations.
+ *
+ * SYNOPSYS:
+ *
+ * void housetuya_json_reset (TuyaJson *json);
+ *
+ *    Start a new document. The json structure must be zero-initialized
+ *    before its first use. Any memory already allocated is reused.
+ *
+ * void housetuya_json_free (TuyaJson *json);
+ *
+ *    Release the memory used by this writer.
+ *
+ * void housetuya_json_object (TuyaJson *json, const char *key);
+ * void housetuya_json_array  (TuyaJson *json, const char *key);
+ * void housetuya_json_end    (TuyaJson *json);
+ *
+ *    Open a new object or array, or close the last one opened. The key
+ *    must be 0 for an array element or for the document's root.
+ *
+ * void housetuya_json_string  (TuyaJson *json, const char *key, const char *value);
+ * void housetuya_json_integer (TuyaJson *json, const char *key, long long value);
+ * void housetuya_json_real    (TuyaJson *json, const char *key, double value);
+ * void housetuya_json_bool    (TuyaJson *json, const char *key, int value);
+ *
+ *    Add a value to the current object or array. The string value is
+ *    escaped as needed. The real value is written with the fewest digits
+ *    that read back as the same value.
+ *
+ * void housetuya_json_fragment (TuyaJson *json, const char *text, int length);
+ *
+ *    Add an item that was formatted earlier, for example by another writer.
+ *    For an object, the text must include the key.
+ *
+ * const char *housetuya_json_text (TuyaJson *json);
+ * int housetuya_json_length (const TuyaJson *json);
+ *
+ *    Return the JSON text (0 if there was an error), or its length.
+ *    Any container still open is not closed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "housetuya_json.h"
+
+// Make room for at least the specified number of additional characters,
+// plus the string terminator.
+//
+static int housetuya_json_room (TuyaJson *json, int needed) {
+
+    if (json->error) return 0;
+    if (json->length + needed < json->size) return 1;
+
+    int size = json->size ? json->size : 1024;
+    while (json->length + needed >= size) size *= 2;
+
+    char *data = realloc (json->data, size);
+    if (!data) {
+        json->error = 1;
+        return 0;
+    }
+    json->data = data;
+    json->size = size;
+    return 1;
+}
+
+static void housetuya_json_raw (TuyaJson *json, const char *text, int length) {
+    if (!housetuya_json_room (json, length)) return;
+    memcpy (json->data + json->length, text, length);
+    json->length += length;
+    json->data[json->length] = 0;
+}
+
+static void housetuya_json_quote (TuyaJson *json, const char *text) {
+
+    const char *s = text;
+
+    housetuya_json_raw (json, "\"", 1);
+
+    while (*s) {
+        // Copy the longest run of characters that need no escape.
+        const char *run = s;
+        while (*s && (*s != '"') && (*s != '\\') && ((unsigned char)(*s) >= 0x20))
+            s += 1;
+        if (s > run) housetuya_json_raw (json, run, s - run);
+        if (!*s) break;
+
+        char escape[8];
+        switch (*s) {
+        case '"': case '\\':
+            escape[0] = '\\';
+            escape[1] = *s;
+            housetuya_json_raw (json, escape, 2);
+            break;
+        case '\n':
+            housetuya_json_raw (json, "\\n", 2);
+            break;
+        default:
+            housetuya_json_raw (json, escape,
+                                snprintf (escape, sizeof(escape),
+                                          "\\u%04x", (unsigned char)(*s)));
+        }
+        s += 1;
+    }
+    housetuya_json_raw (json, "\"", 1);
+}
+
+// Write the separator and key that come before any new item.
+//
+static void housetuya_json_item (TuyaJson *json, const char *key) {
+
+    if (json->items[json->depth]++ > 0) housetuya_json_raw (json, ",", 1);
+    if (key) {
+        housetuya_json_quote (json, key);
+        housetuya_json_raw (json, ":", 1);
+    }
+}
+
+static void housetuya_json_open (TuyaJson *json, const char *key,
+                                 char opening, char closing) {
+
+    if (json->depth >= TUYA_JSON_DEPTH - 1) {
+        json->error = 1;
+        return;
+    }
+    housetuya_json_item (json, key);
+    housetuya_json_raw (json, &opening, 1);
+    json->depth += 1;
+    json->items[json->depth] = 0;
+    json->closing[json->depth] = closing;
+}
+
+void housetuya_json_reset (TuyaJson *json) {
+    json->length = 0;
+    json->depth = 0;
+    json->items[0] = 0;
+    json->error = 0;
+    if (json->data) json->data[0] = 0;
+}
+
+void housetuya_json_free (TuyaJson *json) {
+    if (json->data) free (json->data);
+    json->data = 0;
+    json->size = 0;
+    housetuya_json_reset (json);
+}
+
+void housetuya_json_object (TuyaJson *json, const char *key) {
+    housetuya_json_open (json, key, '{', '}');
+}
+
+void housetuya_json_array (TuyaJson *json, const char *key) {
+    housetuya_json_open (json, key, '[', ']');
+}
+
+void housetuya_json_end (TuyaJson *json) {
+    if (json->depth <= 0) {
+        json->error = 1;
+        return;
+    }
+    housetuya_json_raw (json, json->closing + json->depth, 1);
+    json->depth -= 1;
+}
+
+void housetuya_json_string (TuyaJson *json, const char *key, const char *value) {
+    housetuya_json_item (json, key);
+    housetuya_json_quote (json, value ? value : "");
+}
+
+void housetuya_json_integer (TuyaJson *json, const char *key, long long value) {
+    char ascii[32];
+    housetuya_json_item (json, key);
+    housetuya_json_raw (json, ascii, snprintf (ascii, sizeof(ascii), "%lld", value));
+}
+
+void housetuya_json_real (TuyaJson *json, const char *key, double value) {
+    char ascii[32];
+    int length = 0;
+    int precision;
+    for (precision = 15; precision <= 17; ++precision) {
+        length = snprintf (ascii, sizeof(ascii), "%.*g", precision, value);
+        if (strtod (ascii, 0) == value) break;
+    }
+    housetuya_json_item (json, key);
+    housetuya_json_raw (json, ascii, length);
+}
+
+void housetuya_json_bool (TuyaJson *json, const char *key, int value) {
+    housetuya_json_item (json, key);
+    if (value)
+        housetuya_json_raw (json, "true", 4);
+    else
+        housetuya_json_raw (json, "false", 5);
+}
+
+void housetuya_json_fragment (TuyaJson *json, const char *text, int length) {
+    housetuya_json_item (json, 0);
+    housetuya_json_raw (json, text, length);
+}
+
+const char *housetuya_json_text (TuyaJson *json) {
+    if (json->error) return 0;
+    if (!housetuya_json_room (json, 0)) return 0; // Never written to.
+    json->data[json->length] = 0;
+    return json->data;
+}
+
+int housetuya_json_length (const TuyaJson *json) {
+    return json->length;
+}
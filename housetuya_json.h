@@ -0,0 +1,50 @@
+/* HouseTuya - A simple home web server for control of Tuya Devices
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housetuya_json.h - A simple streaming JSON writer.
+ */
+#define TUYA_JSON_DEPTH 16
+
+typedef struct {
+    char *data;
+    int length;
+    int size;
+    int depth;
+    int items[TUYA_JSON_DEPTH];    // Items already written at each level.
+    char closing[TUYA_JSON_DEPTH]; // How to close each level.
+    int error;
+} TuyaJson;
+
+void housetuya_json_reset (TuyaJson *json);
+void housetuya_json_free  (TuyaJson *json);
+
+void housetuya_json_object (TuyaJson *json, const char *key);
+void housetuya_json_array  (TuyaJson *json, const char *key);
+void housetuya_json_end    (TuyaJson *json);
+
+void housetuya_json_string  (TuyaJson *json, const char *key, const char *value);
+void housetuya_json_integer (TuyaJson *json, const char *key, long long value);
+void housetuya_json_real    (TuyaJson *json, const char *key, double value);
+void housetuya_json_bool    (TuyaJson *json, const char *key, int value);
+
+void housetuya_json_fragment (TuyaJson *json, const char *text, int length);
+
+const char *housetuya_json_text (TuyaJson *json);
+int housetuya_json_length (const TuyaJson *json);
@@ -26,30 +26,109 @@
  *     char *id;
  *     char *key;
  *     char *version;
+ *     int negotiated;
+ *     unsigned char nonce[16];
+ *     unsigned char session[16];
+ *     struct TuyaCipher *cipher;
+ *     struct TuyaCipher *sessioncipher;
  * } TuyaSecret;
  *
- * int housetuya_control (char *buffer, int size, const TuyaSecret *access,
+ *    The id, key and version items must be set by the application. The
+ *    other items hold the protocol 3.4+ session state and cached cipher
+ *    contexts, and are maintained by this library: they must be
+ *    zero-initialized.
+ *
+ * int housetuya_control (char *buffer, int size, TuyaSecret *access,
  *                        int sequence, int dps, int value);
  *
  *    Prepare a control message in buffer, return its length (or 0 on error).
+ *    This sets one boolean data point.
+ *
+ * typedef struct {
+ *     int id;
+ *     int type;
+ *     union {
+ *         int bool;
+ *         int integer;
+ *         double real;
+ *         const char *string;
+ *     } value;
+ * } TuyaDataPoint;
+ *
+ * int housetuya_control_dps (char *buffer, int size, TuyaSecret *access,
+ *                            int sequence, const TuyaDataPoint *dps, int count);
+ *
+ *    Prepare a control message that sets several data points at once,
+ *    return its length (or 0 on error). The type of each data point is
+ *    TUYA_DPS_BOOL, TUYA_DPS_INTEGER, TUYA_DPS_REAL or TUYA_DPS_STRING.
  *
- * int housetuya_query (char *buffer, int size, const TuyaSecret *access,
+ * int housetuya_query (char *buffer, int size, TuyaSecret *access,
  *                      int sequence);
  *
  *    Prepare a query message in buffer, return its length (or 0 on error).
  *
- * int housetuya_extract (char *buffer, int size, const TuyaSecret *access,
+ * int housetuya_heartbeat (char *buffer, int size, TuyaSecret *access,
+ *                          int sequence);
+ *
+ *    Prepare a heartbeat message in buffer, return its length (or 0 on error).
+ *    A device closes its TCP connections if it does not receive anything
+ *    for about 30 seconds: heartbeats keep an idle connection open.
+ *
+ * int housetuya_session_ready (const TuyaSecret *access);
+ *
+ *    Return 1 if messages can be exchanged with the device, 0 if a session
+ *    key must be negotiated first. Protocol versions older than 3.4 do not
+ *    use a session key: these are always ready.
+ *
+ * int housetuya_session_start (char *buffer, int size, TuyaSecret *access,
+ *                              int sequence);
+ *
+ *    Prepare the first message (SESS_KEY_NEG_START) of the protocol 3.4
+ *    session key negotiation, return its length (or 0 on error). This is
+ *    needed once for each new connection.
+ *
+ * int housetuya_session_finish (char *buffer, int size, TuyaSecret *access,
+ *                               int sequence, const char *data, int length);
+ *
+ *    Process the payload of the SESS_KEY_NEG_RESP message received from the
+ *    device, and prepare the last message (SESS_KEY_NEG_FINISH). Return the
+ *    length of that message, or 0 if the device response is not valid.
+ *    The session key is in use, for both directions, once this function
+ *    has returned successfully: the message in buffer is the last one
+ *    encrypted with the device's local key.
+ *
+ * void housetuya_session_reset (TuyaSecret *access);
+ *
+ *    Forget the current session key. This must be called when the
+ *    connection is closed.
+ *
+ * void housetuya_forget (TuyaSecret *access);
+ *
+ *    Release the cached cipher contexts. This must be called when the
+ *    key is changed.
+ *
+ * int housetuya_frame (const char *raw, int length);
+ *
+ *    Locate the first message in a stream of received data. Return the
+ *    length of the message if it is complete, 0 if more data is needed,
+ *    or -n if the first n bytes do not belong to any message and must
+ *    be discarded. This is used to split a TCP stream into messages, since
+ *    a device may send several messages at once, or a message may be split
+ *    across multiple reads.
+ *
+ * int housetuya_extract (char *buffer, int size, TuyaSecret *access,
  *                        int *code, int *sequence, const char *raw, int length);
  *
  *    Extract the JSON payload from the specified message and return its
  *    length, or 0 on error.
  *
  *    The JSON payload is still to be decoded and interpreted according to
- *    the value of code.
+ *    the value of code. Some responses, like the heartbeat response, have
+ *    no payload: in that case code is still set, but the length is 0.
  *
  * PROTOCOL:
  *
- * The supported versions of the Tuya protocol are: 3.1, 3.3, 3.4
+ * The supported versions of the Tuya protocol are: 3.1, 3.3, 3.4, 3.5
  *
  * If no version is specified, the program uses 3.3. It might not always work.
  *
@@ -68,18 +147,48 @@
  *
  * 3.4 command packets:
  *
- *  prefix(4), seq(4), cmd(4), length(4), ['3.4'(15)], data, hmac(32), suffix(4)
- *                                                           --------
+ *  prefix(4), seq(4), cmd(4), length(4), data, hmac(32), suffix(4)
+ *                                              --------
  *
- * (No "3.4"(15) header for QUERY or REFRESH.)
+ * (The data starts with a "3.4"(15) header, except for QUERY or REFRESH.
+ * Unlike 3.3, this header is encrypted along with the JSON payload.)
  *
  * 3.4 response packets:
  *
  *  prefix(4), seq(4), cmd(4), length(4), [code(4)], data, hmac(32), suffix(4)
  *                                                         --------
+ *
+ * The protocol 3.4 messages are encrypted using a session key, which is
+ * negotiated after the connection was established:
+ * - SESS_KEY_NEG_START: local nonce (16), encrypted with the local key.
+ * - SESS_KEY_NEG_RESP: device nonce (16), HMAC of the local nonce (32).
+ * - SESS_KEY_NEG_FINISH: HMAC of the device nonce (32).
+ * The session key is the first 16 bytes of (local nonce XOR device nonce)
+ * encrypted with the local key. All HMACs are SHA256, using the local key
+ * during the negotiation and the session key after.
+ *
+ * 3.4 devices use the CONTROL_NEW and QUERY_NEW commands, and the data
+ * points are embedded in a "data" object:
+ *
+ *  {"protocol":5,"t":<TIME>,"data":{"dps":{"20":true}}}
+ *
+ * 3.5 packets:
+ *
+ *  prefix(4), 0(2), seq(4), cmd(4), length(4), iv(12), data, tag(16), suffix(4)
+ *  --------                                    ------        -------  --------
+ *
+ * The 3.5 prefix is 0x00006699 and the suffix is 0x00009966. The data is
+ * encrypted using AES-GCM, with a random IV for each message and the
+ * header (except the prefix) as additional authenticated data. In a
+ * response the return code, if any, is encrypted with the data. The
+ * extended header, the session negotiation and the commands are the same
+ * as for 3.4, except that the session key is the first 16 bytes of
+ * (local nonce XOR device nonce) encrypted using AES-GCM, with the first
+ * 12 bytes of the local nonce as the IV.
  */
 
 #include <time.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -113,6 +222,49 @@ static void housetuya_dump (const char *intro, int ip, const char *data, int siz
 }
 
 
+// Return the protocol version as an integer (e.g. 33 for version 3.3).
+//
+static int housetuya_protocol (const TuyaSecret *access) {
+    if ((!access->version) || (!access->version[0])) return 33;
+    int major = access->version[0] - '0';
+    int minor = (access->version[1] == '.') ? access->version[2] - '0' : 0;
+    return (major * 10) + minor;
+}
+
+// Return the key that encrypts the messages at this stage of the session.
+//
+static const unsigned char *housetuya_key (const TuyaSecret *access) {
+    if (access->negotiated) return access->session;
+    return (const unsigned char *)(access->key);
+}
+
+// Return the cipher context for the key in use at this stage of the session.
+//
+static struct TuyaCipher *housetuya_cipher (TuyaSecret *access) {
+    if (access->negotiated) return access->sessioncipher;
+    if (!access->cipher) {
+        if (!access->key) return 0;
+        access->cipher =
+            housetuya_cipher_new ((const unsigned char *)(access->key));
+    }
+    return access->cipher;
+}
+
+// The 3.5 header fields are not aligned on 32 bits boundaries.
+//
+static void housetuya_put32 (char *buffer, unsigned int value) {
+    unsigned char *b = (unsigned char *)buffer;
+    b[0] = (value >> 24) & 0xff;
+    b[1] = (value >> 16) & 0xff;
+    b[2] = (value >> 8) & 0xff;
+    b[3] = value & 0xff;
+}
+
+static unsigned int housetuya_get32 (const char *buffer) {
+    const unsigned char *b = (const unsigned char *)buffer;
+    return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
 static int housetuya_start_envelop (char *buffer, int sequence, int code) {
     int *header = (int *)buffer;
     header[0] = htonl(0x000055aa);
@@ -131,53 +283,377 @@ static int housetuya_end_envelop_pre34 (char *buffer, int length) {
     return length + 8;
 }
 
-static int housetuya_encode (char *buffer, int size, const TuyaSecret *access,
-                             int code, int sequence, char *data) {
+static int housetuya_end_envelop_34 (char *buffer, int length,
+                                     const unsigned char *key) {
+    int *header = (int *)buffer;
+    header[3] = htonl(length+20); // Skip 16 bytes header, add 36 bytes trailer.
+    housetuya_hmac (key, buffer, length, (unsigned char *)buffer+length);
+    int *trailer = (int *)(buffer+length+32);
+    trailer[0] = htonl(0x0000aa55);
+    return length + 36;
+}
+
+static int housetuya_extended_header (int code) {
+    switch (code) {
+        case TUYA_QUERY:
+        case TUYA_QUERY_NEW:
+        case TUYA_UPDATE:
+        case TUYA_HEARTBEAT:
+        case TUYA_SESS_KEY_NEG_START:
+        case TUYA_SESS_KEY_NEG_FINISH:
+            return 0;
+    }
+    return 1;
+}
+
+// Protocol 3.4 and later: the extended header is part of the encrypted data.
+//
+static int housetuya_cleartext (char *clear, int size, const TuyaSecret *access,
+                                int code, const char *data, int length) {
+    int clearlength = 0;
+    if (length > size - 15) return 0;
+    if (housetuya_extended_header (code)) {
+        memset (clear, 0, 15);
+        strncpy (clear, access->version, 15);
+        clearlength = 15;
+    }
+    memcpy (clear+clearlength, data, length);
+    return clearlength + length;
+}
+
+static int housetuya_encode_35 (char *buffer, int size, TuyaSecret *access,
+                                int code, int sequence,
+                                const char *data, int length) {
+
+    char clear[1024+15];
+    int clearlength =
+        housetuya_cleartext (clear, sizeof(clear), access, code, data, length);
+    if (clearlength <= 0) return 0;
 
-    int length = strlen(data);
-    if (length > size-15) {
-        printf ("** Data too large to encode: %d (max %d)\n", length, size-15);
+    // Header, IV, data, tag and suffix.
+    if (18 + 12 + clearlength + 16 + 4 > size) {
+        printf ("** Data too large to encode: %d (max %d)\n", length, size-65);
+        return 0;
+    }
+    struct TuyaCipher *cipher = housetuya_cipher (access);
+    if (!cipher) return 0;
+
+    housetuya_put32 (buffer, 0x00006699);
+    buffer[4] = buffer[5] = 0;
+    housetuya_put32 (buffer+6, sequence);
+    housetuya_put32 (buffer+10, code);
+    housetuya_put32 (buffer+14, 12 + clearlength + 16);
+
+    unsigned char *iv = (unsigned char *)buffer + 18;
+    housetuya_random (iv, 12);
+    char *encrypted = buffer + 30;
+    unsigned char *tag = (unsigned char *)encrypted + clearlength;
+    if (housetuya_encrypt_gcm (cipher, iv, buffer+4, 14,
+                               encrypted, clear, clearlength, tag)
+            != clearlength) return 0;
+    housetuya_put32 (encrypted + clearlength + 16, 0x00009966);
+
+    length = 30 + clearlength + 16 + 4;
+    housetuya_dump ("Encrypted command", 0, buffer, length);
+    return length;
+}
+
+static int housetuya_encode (char *buffer, int size, TuyaSecret *access,
+                             int code, int sequence,
+                             const char *data, int length) {
+
+    int protocol = housetuya_protocol (access);
+    if (protocol >= 35)
+        return housetuya_encode_35 (buffer, size, access, code, sequence,
+                                    data, length);
+
+    // Worst case: header, extended header, padding and 3.4 trailer.
+    if (16 + 15 + length + 16 + 36 > size) {
+        printf ("** Data too large to encode: %d (max %d)\n", length, size-83);
         return 0;
     }
-    // TBD: no 3.4 support, only versions 3.2 & 3.3 for now.
-    //
     int cursor = housetuya_start_envelop (buffer, sequence, code);
-    if ((code != TUYA_QUERY) && (code != TUYA_UPDATE)) {
-        // REFRESH and QUERY have no extended header. Others do.
-        memset (buffer+cursor, 0, 15);
-        strncpy (buffer+cursor, access->version, 15);
-        cursor += 15;
-    }
-    length = cursor + housetuya_encrypt (access->key, buffer+cursor, data, length);
-    length = housetuya_end_envelop_pre34 (buffer, length);
+
+    if (protocol >= 34) {
+        char clear[1024+15];
+        int clearlength = housetuya_cleartext (clear, sizeof(clear), access,
+                                               code, data, length);
+        if (clearlength <= 0) return 0;
+        struct TuyaCipher *cipher = housetuya_cipher (access);
+        if (!cipher) return 0;
+        int crypted = housetuya_encrypt (cipher, buffer+cursor, clear, clearlength);
+        if (crypted <= 0) return 0;
+        length = housetuya_end_envelop_34 (buffer, cursor + crypted,
+                                           housetuya_key (access));
+    } else {
+        if (housetuya_extended_header (code)) {
+            // REFRESH, QUERY and HEARTBEAT have no extended header. Others do.
+            memset (buffer+cursor, 0, 15);
+            strncpy (buffer+cursor, access->version, 15);
+            cursor += 15;
+        }
+        struct TuyaCipher *cipher = housetuya_cipher (access);
+        if (!cipher) return 0;
+        int crypted = housetuya_encrypt (cipher, buffer+cursor, data, length);
+        if (crypted <= 0) return 0;
+        length = housetuya_end_envelop_pre34 (buffer, cursor + crypted);
+    }
     housetuya_dump ("Encrypted command", 0, buffer, length);
     return length;
 }
 
-int housetuya_control (char *buffer, int size, const TuyaSecret *access,
-                       int sequence, int dps, int value) {
+// Format a real number using the fewest digits that read back as the
+// same value, so that no precision is lost.
+//
+static int housetuya_format_real (char *buffer, int size, double value) {
+    int precision;
+    int length = 0;
+    for (precision = 15; precision <= 17; ++precision) {
+        length = snprintf (buffer, size, "%.*g", precision, value);
+        if ((length >= size) || (strtod (buffer, 0) == value)) break;
+    }
+    return length;
+}
+
+// Format the value of one data point, return the length used (or -1
+// if there is not enough space).
+//
+static int housetuya_format_dps (char *buffer, int size,
+                                 const TuyaDataPoint *dps) {
+
+    int length;
+
+    switch (dps->type) {
+    case TUYA_DPS_BOOL:
+        length = snprintf (buffer, size, "\"%d\":%s",
+                           dps->id, dps->value.bool?"true":"false");
+        break;
+    case TUYA_DPS_INTEGER:
+        length = snprintf (buffer, size, "\"%d\":%d",
+                           dps->id, dps->value.integer);
+        break;
+    case TUYA_DPS_REAL:
+        length = snprintf (buffer, size, "\"%d\":", dps->id);
+        if (length >= size) return -1;
+        length += housetuya_format_real (buffer+length, size-length,
+                                         dps->value.real);
+        break;
+    case TUYA_DPS_STRING:
+        length = snprintf (buffer, size, "\"%d\":\"", dps->id);
+        if (length >= size) return -1;
+        const char *s;
+        for (s = dps->value.string; *s; ++s) {
+            if (length + 8 >= size) return -1;
+            if ((*s == '"') || (*s == '\\')) {
+                buffer[length++] = '\\';
+                buffer[length++] = *s;
+            } else if ((unsigned char)(*s) < 0x20) {
+                length += snprintf (buffer+length, size-length,
+                                    "\\u%04x", (unsigned char)(*s));
+            } else {
+                buffer[length++] = *s;
+            }
+        }
+        if (length + 2 > size) return -1;
+        buffer[length++] = '"';
+        buffer[length] = 0;
+        break;
+    default:
+        DEBUG ("** Invalid type %d for data point %d\n", dps->type, dps->id);
+        return -1;
+    }
+    return (length < size) ? length : -1;
+}
+
+int housetuya_control_dps (char *buffer, int size, TuyaSecret *access,
+                           int sequence, const TuyaDataPoint *dps, int count) {
 
-    static const char Format[] =
-        "{\"devId\":\"%s\",\"uid\":\"%s\",\"t\":\"%d\",\"dps\":{\"%d\":%s}}";
     char command[1024];
-    snprintf (command, sizeof(command), Format,
-              access->id, access->id, (int)time(0), dps, value?"true":"false");
+    int length;
+    int code = TUYA_CONTROL;
+    int i;
+
+    if (count <= 0) return 0;
+
+    if (housetuya_protocol (access) >= 34) {
+        length = snprintf (command, sizeof(command),
+                           "{\"protocol\":5,\"t\":%d,\"data\":{\"dps\":{",
+                           (int)time(0));
+        code = TUYA_CONTROL_NEW;
+    } else {
+        length = snprintf (command, sizeof(command),
+                           "{\"devId\":\"%s\",\"uid\":\"%s\",\"t\":\"%d\",\"dps\":{",
+                           access->id, access->id, (int)time(0));
+    }
+    for (i = 0; i < count; ++i) {
+        if (i > 0) command[length++] = ',';
+        int added = housetuya_format_dps (command+length,
+                                          sizeof(command)-length-5, dps+i);
+        if (added < 0) {
+            DEBUG ("** Control command too long\n");
+            return 0;
+        }
+        length += added;
+    }
+    if (code == TUYA_CONTROL_NEW) command[length++] = '}';
+    command[length++] = '}';
+    command[length++] = '}';
+    command[length] = 0;
+
     DEBUG ("Command: %s\n", command);
-    return housetuya_encode (buffer, size, access, TUYA_CONTROL, sequence, command);
+    return housetuya_encode (buffer, size, access, code, sequence,
+                             command, length);
 }
 
-int housetuya_query (char *buffer, int size, const TuyaSecret *access,
+int housetuya_control (char *buffer, int size, TuyaSecret *access,
+                       int sequence, int dps, int value) {
+
+    TuyaDataPoint point;
+
+    point.id = dps;
+    point.type = TUYA_DPS_BOOL;
+    point.value.bool = value;
+    return housetuya_control_dps (buffer, size, access, sequence, &point, 1);
+}
+
+int housetuya_query (char *buffer, int size, TuyaSecret *access,
                      int sequence) {
 
     static const char Format[] =
         "{\"devId\":\"%s\",\"uid\":\"%s\",\"t\":\"%d\"}";
     char command[1024];
+    if (housetuya_protocol (access) >= 34) {
+        return housetuya_encode (buffer, size, access, TUYA_QUERY_NEW, sequence,
+                                 "{}", 2);
+    }
     snprintf (command, sizeof(command), Format,
               access->id, access->id, (int)time(0));
-    return housetuya_encode (buffer, size, access, TUYA_QUERY, sequence, command);
+    return housetuya_encode (buffer, size, access, TUYA_QUERY, sequence,
+                             command, strlen(command));
+}
+
+int housetuya_heartbeat (char *buffer, int size, TuyaSecret *access,
+                         int sequence) {
+
+    static const char Format[] = "{\"gwId\":\"%s\",\"devId\":\"%s\"}";
+    char command[1024];
+    snprintf (command, sizeof(command), Format, access->id, access->id);
+    return housetuya_encode (buffer, size, access, TUYA_HEARTBEAT, sequence,
+                             command, strlen(command));
+}
+
+int housetuya_session_ready (const TuyaSecret *access) {
+    if (housetuya_protocol (access) < 34) return 1;
+    return access->negotiated;
+}
+
+int housetuya_session_start (char *buffer, int size, TuyaSecret *access,
+                             int sequence) {
+    access->negotiated = 0;
+    housetuya_random (access->nonce, sizeof(access->nonce));
+    return housetuya_encode (buffer, size, access, TUYA_SESS_KEY_NEG_START,
+                             sequence, (const char *)(access->nonce),
+                             sizeof(access->nonce));
+}
+
+int housetuya_session_finish (char *buffer, int size, TuyaSecret *access,
+                              int sequence, const char *data, int length) {
+
+    unsigned char hmac[32];
+    const unsigned char *key = (const unsigned char *)(access->key);
+
+    // The device proves that it knows the local key by returning
+    // the HMAC of our nonce.
+    //
+    if (length < 48) {
+        DEBUG ("** Session response too short: %d\n", length);
+        return 0;
+    }
+    housetuya_hmac (key, (const char *)(access->nonce),
+                    sizeof(access->nonce), hmac);
+    if (memcmp (hmac, data+16, sizeof(hmac))) {
+        DEBUG ("** Invalid session response HMAC\n");
+        return 0;
+    }
+
+    housetuya_hmac (key, data, 16, hmac);
+    int result = housetuya_encode (buffer, size, access,
+                                   TUYA_SESS_KEY_NEG_FINISH, sequence,
+                                   (const char *)hmac, sizeof(hmac));
+    if (result <= 0) return 0;
+
+    int i;
+    char mixed[16];
+    char encrypted[32];
+    for (i = 0; i < 16; ++i) mixed[i] = access->nonce[i] ^ data[i];
+    struct TuyaCipher *cipher = housetuya_cipher (access);
+    if (!cipher) return 0;
+    if (housetuya_protocol (access) >= 35) {
+        if (housetuya_encrypt_gcm (cipher, access->nonce, 0, 0,
+                                   encrypted, mixed, 16, 0) != 16) return 0;
+    } else {
+        // ECB encodes each block independently: the first 16 bytes are the
+        // same with or without the trailing padding.
+        if (housetuya_encrypt (cipher, encrypted, mixed, 16) < 16) return 0;
+    }
+    memcpy (access->session, encrypted, sizeof(access->session));
+
+    // The session cipher context is built once per session, not per message.
+    housetuya_cipher_free (access->sessioncipher);
+    access->sessioncipher = housetuya_cipher_new (access->session);
+    if (!access->sessioncipher) return 0;
+    access->negotiated = 1;
+    return result;
+}
+
+void housetuya_session_reset (TuyaSecret *access) {
+    access->negotiated = 0;
+}
+
+void housetuya_forget (TuyaSecret *access) {
+    access->negotiated = 0;
+    housetuya_cipher_free (access->cipher);
+    access->cipher = 0;
+    housetuya_cipher_free (access->sessioncipher);
+    access->sessioncipher = 0;
+}
+
+int housetuya_frame (const char *raw, int length) {
+
+    static const char Prefix[4] = {0x00, 0x00, 0x55, (char)0xaa};
+    static const char Prefix35[4] = {0x00, 0x00, 0x66, (char)0x99};
+    int i;
+
+    // Resynchronize on the next prefix if the data does not start with one.
+    for (i = 0; i < length; ++i) {
+        int remaining = length - i;
+        if (remaining > 4) remaining = 4;
+        if (!memcmp (raw+i, Prefix, remaining)) break;
+        if (!memcmp (raw+i, Prefix35, remaining)) break;
+    }
+    if (i > 0) return -i;
+
+    if (length < 4) return 0;
+    int header_length = 16; // Prefix, sequence, code, length.
+    int trailer_length = 0;  // The suffix is included in the length.
+    int minimum = 8;         // CRC and suffix.
+    if (!memcmp (raw, Prefix35, 4)) {
+        header_length = 18;  // Prefix, 0, sequence, code, length.
+        trailer_length = 4;  // The suffix is not included in the length.
+        minimum = 28;        // IV and tag.
+    }
+    if (length < header_length) return 0;
+    int payload_length = housetuya_get32 (raw + header_length - 4);
+    if ((payload_length < minimum) || (payload_length > 0x10000)) {
+        DEBUG ("** invalid message length %d\n", payload_length);
+        return -4; // Not a valid header: skip that prefix.
+    }
+    int total = header_length + payload_length + trailer_length;
+    if (length < total) return 0;
+    return total;
 }
 
-static int housetuya_open_envelop (const char *version,
+static int housetuya_open_envelop (const char *version, int trailer_length,
                                    const char *buffer, int length,
                                    const char **data, int *code, int *sequence) {
     const int *header = (const int *)buffer;
@@ -193,8 +669,8 @@ static int housetuya_open_envelop (const char *version,
         DEBUG ("** invalid length %d (expected %d)\n", payload_length, length - 16);
         return 0;
     }
-    const int *trailer = (const int *)(buffer + length - 8);
-    int suffix = ntohl(trailer[1]);
+    const int *trailer = (const int *)(buffer + length - 4);
+    int suffix = ntohl(trailer[0]);
     if (suffix != 0x0000aa55) {
         DEBUG ("** invalid suffix %04x\n", suffix);
         return 0;
@@ -202,20 +678,21 @@ static int housetuya_open_envelop (const char *version,
 
     // Do not check the CRC for now: the CRC of commands does not even seem
     // to be checked by the devices (makes sense: UDP and TCP data is already
-    // protected by at least two layers of CRC).
+    // protected by at least two layers of CRC). The 3.4 HMAC is not checked
+    // either: the device was authenticated during the session negotiation.
 
     // Apparently some messages might not have a return code?
     // Return codes are always in the range 0..255. We ignore them for now..
     if (ntohl(header[4]) & 0xffffff00) {
         *data = buffer + 16;
-        length -= (16 + 8);
+        length -= (16 + trailer_length);
     } else {
         *data = buffer + 20; // + return code.
-        length -= (20 + 8);
+        length -= (20 + trailer_length);
     }
 
     // some (most, actually) messages have an extended header
-    if (version && (!strcmp(version, *data))) {
+    if (version && (length >= 15) && (!strcmp(version, *data))) {
         length -= 15;
         DEBUG ("Found extended header for version %s, length = %d\n", *data, length);
         *data += 15;
@@ -223,7 +700,56 @@ static int housetuya_open_envelop (const char *version,
     return length;
 }
 
-int housetuya_extract (char *buffer, int size, const TuyaSecret *secret,
+static int housetuya_extract_35 (char *buffer, int size, TuyaSecret *secret,
+                                 int *code, int *sequence,
+                                 const char *raw, int length) {
+
+    if (length < 18 + 12 + 16 + 4) {
+        DEBUG ("** message too short (%d)\n", length);
+        return 0;
+    }
+    if (sequence) *sequence = housetuya_get32 (raw+6);
+    if (code) *code = housetuya_get32 (raw+10);
+    int payload_length = housetuya_get32 (raw+14);
+    if (payload_length != length - 22) {
+        DEBUG ("** invalid length %d (expected %d)\n", payload_length, length - 22);
+        return 0;
+    }
+    int suffix = housetuya_get32 (raw + length - 4);
+    if (suffix != 0x00009966) {
+        DEBUG ("** invalid suffix %04x\n", suffix);
+        return 0;
+    }
+    int datalen = payload_length - 12 - 16;
+    if (datalen <= 0) return 0; // No payload.
+    if (datalen >= size) {
+        DEBUG ("** Payload too large: %d (max %d)\n", datalen, size-1);
+        return 0;
+    }
+    if (!secret) return 0; // 3.5 messages are always encrypted.
+    struct TuyaCipher *cipher = housetuya_cipher (secret);
+    if (!cipher) return 0;
+
+    const unsigned char *iv = (const unsigned char *)raw + 18;
+    const char *data = raw + 30;
+    const unsigned char *tag = (const unsigned char *)data + datalen;
+    datalen = housetuya_decrypt_gcm (cipher, iv, raw+4, 14,
+                                     data, buffer, datalen, tag);
+    if (datalen <= 0) return 0;
+
+    // Return codes are always in the range 0..255 (see above).
+    if ((datalen >= 4) && ((housetuya_get32 (buffer) & 0xffffff00) == 0)) {
+        datalen -= 4;
+        memmove (buffer, buffer+4, datalen);
+    }
+    if (secret->version && (datalen >= 15) && (!strcmp (secret->version, buffer))) {
+        datalen -= 15;
+        memmove (buffer, buffer+15, datalen);
+    }
+    return datalen;
+}
+
+int housetuya_extract (char *buffer, int size, TuyaSecret *secret,
                        int *code, int *sequence, const char *raw, int length) {
 
     if (length <= 0) {
@@ -235,13 +761,43 @@ int housetuya_extract (char *buffer, int size, const TuyaSecret *secret,
     const char *data = 0;
     int datalen;
 
-    if (secret) {
-        datalen = housetuya_open_envelop (secret->version, raw, length, &data, code, sequence);
+    if ((length >= 4) && (housetuya_get32 (raw) == 0x00006699)) {
+        datalen = housetuya_extract_35 (buffer, size, secret,
+                                        code, sequence, raw, length);
+        if (datalen <= 0) return 0;
+    } else if (secret && (housetuya_protocol (secret) >= 34)) {
+        // The extended header is encrypted: look for it after decryption.
+        datalen = housetuya_open_envelop (0, 36, raw, length, &data, code, sequence);
+        if (datalen <= 0) return 0; // No payload (e.g. heartbeat), or error.
+        if (datalen >= size) {
+            DEBUG ("** Payload too large: %d (max %d)\n", datalen, size-1);
+            return 0;
+        }
+        struct TuyaCipher *cipher = housetuya_cipher (secret);
+        if (!cipher) return 0;
+        datalen = housetuya_decrypt (cipher, data, buffer, datalen);
         if (datalen <= 0) return 0;
-        datalen = housetuya_decrypt (secret->key, data, buffer, datalen);
+        if ((datalen >= 15) && (!strcmp (secret->version, buffer))) {
+            datalen -= 15;
+            memmove (buffer, buffer+15, datalen);
+        }
+    } else if (secret) {
+        datalen = housetuya_open_envelop (secret->version, 8, raw, length, &data, code, sequence);
+        if (datalen <= 0) return 0; // No payload (e.g. heartbeat), or error.
+        if (datalen >= size) {
+            DEBUG ("** Payload too large: %d (max %d)\n", datalen, size-1);
+            return 0;
+        }
+        struct TuyaCipher *cipher = housetuya_cipher (secret);
+        if (!cipher) return 0;
+        datalen = housetuya_decrypt (cipher, data, buffer, datalen);
         if (datalen <= 0) return 0;
     } else {
-        datalen = housetuya_open_envelop (0, raw, length, &data, code, sequence);
+        datalen = housetuya_open_envelop (0, 8, raw, length, &data, code, sequence);
+        if (datalen >= size) {
+            DEBUG ("** Payload too large: %d (max %d)\n", datalen, size-1);
+            return 0;
+        }
         memcpy (buffer, data, datalen);
     }
     DEBUGDUMP ("Decoded data received", 0, buffer, datalen);
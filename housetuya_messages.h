@@ -25,19 +25,63 @@ typedef struct {
     char *id;
     char *key;
     char *version;
+    int negotiated;             // Protocol 3.4+: the session key is in use.
+    unsigned char nonce[16];    // Protocol 3.4+: local session nonce.
+    unsigned char session[16];  // Protocol 3.4+: session key.
+    struct TuyaCipher *cipher;         // Cached context for the key.
+    struct TuyaCipher *sessioncipher;  // Cached context for the session key.
 } TuyaSecret;
 
-#define TUYA_STATUS     8
-#define TUYA_CONTROL    7
-#define TUYA_QUERY     10
-#define TUYA_UPDATE    18
+#define TUYA_SESS_KEY_NEG_START   3
+#define TUYA_SESS_KEY_NEG_RESP    4
+#define TUYA_SESS_KEY_NEG_FINISH  5
+#define TUYA_CONTROL              7
+#define TUYA_STATUS               8
+#define TUYA_HEARTBEAT            9
+#define TUYA_QUERY               10
+#define TUYA_CONTROL_NEW         13
+#define TUYA_QUERY_NEW           16
+#define TUYA_UPDATE              18
 
-int housetuya_control (char *buffer, int size, const TuyaSecret *access,
+#define TUYA_DPS_BOOL      1
+#define TUYA_DPS_INTEGER   2
+#define TUYA_DPS_STRING    3
+#define TUYA_DPS_REAL      4
+
+typedef struct {
+    int id;
+    int type;
+    union {
+        int bool;
+        int integer;
+        double real;
+        const char *string;
+    } value;
+} TuyaDataPoint;
+
+int housetuya_control (char *buffer, int size, TuyaSecret *access,
                        int sequence, int dps, int value);
 
-int housetuya_query (char *buffer, int size, const TuyaSecret *access,
+int housetuya_control_dps (char *buffer, int size, TuyaSecret *access,
+                           int sequence, const TuyaDataPoint *dps, int count);
+
+int housetuya_query (char *buffer, int size, TuyaSecret *access,
                      int sequence);
 
-int housetuya_extract (char *buffer, int size, const TuyaSecret *access,
+int housetuya_heartbeat (char *buffer, int size, TuyaSecret *access,
+                         int sequence);
+
+int housetuya_session_ready (const TuyaSecret *access);
+int housetuya_session_start (char *buffer, int size, TuyaSecret *access,
+                             int sequence);
+int housetuya_session_finish (char *buffer, int size, TuyaSecret *access,
+                              int sequence, const char *data, int length);
+void housetuya_session_reset (TuyaSecret *access);
+
+void housetuya_forget (TuyaSecret *access);
+
+int housetuya_frame (const char *raw, int length);
+
+int housetuya_extract (char *buffer, int size, TuyaSecret *access,
                        int *code, int *sequence, const char *raw, int length);
 
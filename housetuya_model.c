@@ -31,10 +31,11 @@
  *    Indicate if the configuration was changed due to discovery, which
  *    means it must be saved.
  *
- * void housetuya_model_live_config (ParserContext context, int top);
+ * void housetuya_model_live_config (TuyaJson *json);
  *
  *    Recover the current live config, typically to save it to disk after
- *    a change has been detected.
+ *    a change has been detected. This writes the "models" array into the
+ *    current JSON object.
  *
  * const char *housetuya_model_refresh (void);
  *
@@ -48,10 +49,12 @@
  *
  *    Return the data point number used to control this model of devices.
  *
- * KNOWN ISSUES
+ *    The models are indexed by product key (case insensitive). The index is
+ *    rebuilt at the end of each refresh, and only then replaces the old one.
  *
- *    Searching through the database of models is linear. As the list of
- *    product grows, this might not be sustainable.
+ *    A model that is not in the configuration is searched in the catalog
+ *    compiled in from models.csv: the configuration overrides the catalog.
+ *    Only the models from the configuration are exported.
  */
 
 #include <time.h>
@@ -66,8 +69,12 @@
 #include "houselog.h"
 #include "houseconfig.h"
 
+#include "housetuya_hash.h"
+#include "housetuya_json.h"
 #include "housetuya_model.h"
 
+#include "housetuya_catalog.h"
+
 
 struct ModelMap {
     char *id;
@@ -81,6 +88,8 @@ static struct ModelMap *Models;
 static int ModelsCount = 0;
 static int ModelsSpace = 0;
 
+static TuyaHashIndex ModelsById = {0};
+
 int housetuya_model_changed (void) {
     int result = ModelListChanged;
     ModelListChanged = 0;
@@ -89,33 +98,69 @@ int housetuya_model_changed (void) {
 
 static int housetuya_model_search (const char *id) {
     int i;
-    for (i = 0; i < ModelsCount; ++i) {
+    for (i = housetuya_hash_first (&ModelsById, housetuya_hash_nocase (id));
+         i >= 0; i = housetuya_hash_next (&ModelsById, i)) {
         if (!strcasecmp(id, Models[i].id)) return i;
     }
     return -1;
 }
 
+// Search the compiled-in catalog, using the perfect hash computed at
+// build time: there is only one candidate.
+//
+static int housetuya_model_catalog_search (const char *id) {
+#if MODEL_CATALOG_SIZE > 0
+    unsigned int hash = housetuya_hash_nocase (id);
+    unsigned int seed = ModelCatalogSeed[hash % MODEL_CATALOG_BUCKETS];
+    int slot = housetuya_hash_mix (hash, seed) % MODEL_CATALOG_SIZE;
+    if (!ModelCatalog[slot].id) return -1;
+    if (strcasecmp(id, ModelCatalog[slot].id)) return -1;
+    return slot;
+#else
+    return -1;
+#endif
+}
+
+static void housetuya_model_index (void) {
+
+    // Build the new index aside, and switch only when it is complete.
+    TuyaHashIndex index = {0};
+    int i;
+    housetuya_hash_clear (&index, ModelsCount);
+    for (i = 0; i < ModelsCount; ++i)
+        housetuya_hash_add (&index, housetuya_hash_nocase (Models[i].id), i);
+
+    housetuya_hash_free (&ModelsById);
+    ModelsById = index;
+}
+
 const char *housetuya_model_get_name (const char *id) {
     int i = housetuya_model_search (id);
-    if (i < 0) return 0;
-    return Models[i].name;
+    if (i >= 0) return Models[i].name;
+    i = housetuya_model_catalog_search (id);
+    if (i >= 0) return ModelCatalog[i].name;
+    return 0;
 }
 
 int housetuya_model_get_control (const char *id) {
     int i = housetuya_model_search (id);
-    if (i < 0) return 0;
-    return Models[i].control;
+    if (i >= 0) return Models[i].control;
+    i = housetuya_model_catalog_search (id);
+    if (i >= 0) return ModelCatalog[i].control;
+    return 0;
 }
 
 static int housetuya_model_add (const char *id) {
     if (ModelsCount >= ModelsSpace) {
         ModelsSpace = ModelsCount + 16;
         Models = realloc (Models, ModelsSpace * sizeof(struct ModelMap));
-        memset (Models+ModelsSpace, 0,
+        memset (Models+ModelsCount, 0,
                 (ModelsSpace - ModelsCount) * sizeof(struct ModelMap));
     }
     int i = ModelsCount++;
     Models[i].id = strdup(id);
+    // Make the new model visible to searches during the refresh.
+    housetuya_hash_add (&ModelsById, housetuya_hash_nocase (id), i);
     return i;
 }
 
@@ -133,6 +178,7 @@ const char *housetuya_model_refresh (void) {
         if (echttp_isdebug()) fprintf (stderr, "found %d models\n", count);
     } else {
         ModelsCount = 0;
+        housetuya_model_index ();
         return 0;
     }
 
@@ -174,19 +220,22 @@ const char *housetuya_model_refresh (void) {
             ModelListChanged = 1;
         }
     }
+    housetuya_model_index ();
     return 0;
 }
 
-void housetuya_model_live_config (ParserContext context, int top) {
+void housetuya_model_live_config (TuyaJson *json) {
 
-    int items = echttp_json_add_array (context, top, "models");
+    housetuya_json_array (json, "models");
 
     int i;
     for (i = 0; i < ModelsCount; ++i) {
-        int device = echttp_json_add_object (context, items, 0);
-        echttp_json_add_string (context, device, "id", Models[i].id);
-        echttp_json_add_string (context, device, "name", Models[i].name);
-        echttp_json_add_integer (context, device, "control", Models[i].control);
+        housetuya_json_object (json, 0);
+        housetuya_json_string (json, "id", Models[i].id);
+        housetuya_json_string (json, "name", Models[i].name);
+        housetuya_json_integer (json, "control", Models[i].control);
+        housetuya_json_end (json);
     }
+    housetuya_json_end (json);
 }
 
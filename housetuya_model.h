@@ -23,7 +23,7 @@
 
 const char *housetuya_model_initialize (int argc, const char **argv);
 int housetuya_model_changed (void);
-void housetuya_model_live_config (ParserContext context, int top);
+void housetuya_model_live_config (TuyaJson *json);
 const char *housetuya_model_refresh (void);
 const char *housetuya_model_get_name (const char *id);
 int housetuya_model_get_control (const char *id);
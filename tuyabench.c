@@ -0,0 +1,177 @@
+/* tuyabench - Measure the cost of decoding Tuya discovery broadcasts
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * tuyabench.c - Compare the two ways of decoding a discovery broadcast.
+ *
+ * SYNOPSYS:
+ *
+ * tuyabench [-n <count>] [<capture>]
+ *
+ *    Decode each broadcast <count> times (default: 1000000) using the
+ *    dedicated scanner, then using the generic JSON parser, and print
+ *    the average time per broadcast for each method.
+ *
+ *    The capture is a text file with one broadcast per line, in the JSON
+ *    form printed by tuyacmd when scanning for devices: anything before
+ *    the first '{' is ignored, so that the output of tuyacmd can be used
+ *    as is. Without a capture, a built-in set of broadcasts is used.
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "housetuya_broadcast.h"
+
+#define TUYABENCH_MAX 64
+
+static const char *TuyaBenchSamples[] = {
+    "{\"ip\":\"192.168.1.37\",\"gwId\":\"eb1234567890abcdefgh\",\"active\":2,"
+    "\"ablilty\":0,\"encrypt\":true,\"productKey\":\"keyabcdefgh12345\","
+    "\"version\":\"3.3\"}",
+    "{\"ip\":\"192.168.1.52\",\"gwId\":\"bf0987654321zyxwvuts\",\"active\":2,"
+    "\"ablilty\":0,\"encrypt\":true,\"productKey\":\"key3ttqm7pd5zyxw\","
+    "\"version\":\"3.4\",\"token\":true,\"wf_cfg\":true}",
+    "{\"ip\":\"192.168.1.60\",\"gwId\":\"01200885ecfabc123456\",\"active\":2,"
+    "\"ablilty\":0,\"encrypt\":false,\"productKey\":\"keyjup8kd7w4hq3j\","
+    "\"version\":\"3.1\"}",
+    0
+};
+
+static char *TuyaBenchInput[TUYABENCH_MAX];
+static int TuyaBenchCount = 0;
+
+static void tuyabench_add (const char *line) {
+
+    const char *text = strchr (line, '{');
+    if (!text) return;
+    if (TuyaBenchCount >= TUYABENCH_MAX) return;
+
+    char *copy = strdup (text);
+    char *end = copy + strlen(copy);
+    while ((end > copy) && (end[-1] <= ' ')) *(--end) = 0;
+    TuyaBenchInput[TuyaBenchCount++] = copy;
+}
+
+static int tuyabench_load (const char *filename) {
+
+    char line[1024];
+
+    FILE *f = fopen (filename, "r");
+    if (!f) {
+        fprintf (stderr, "tuyabench: cannot open %s\n", filename);
+        return 0;
+    }
+    while (fgets (line, sizeof(line), f)) tuyabench_add (line);
+    fclose (f);
+    return 1;
+}
+
+static double tuyabench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1e9) + now.tv_nsec;
+}
+
+// Both decoders modify their input, so each iteration works on a fresh
+// copy, as the discovery code does. The cost of that copy is measured
+// separately and removed from the results.
+//
+static double tuyabench_run (int method, int count) {
+
+    char buffer[1024];
+    TuyaBroadcast items;
+    volatile int sink = 0;
+    int i;
+
+    double start = tuyabench_now ();
+    for (i = 0; i < count; ++i) {
+        strcpy (buffer, TuyaBenchInput[i % TuyaBenchCount]);
+        switch (method) {
+        case 1:
+            sink += housetuya_broadcast_scan (buffer, &items);
+            break;
+        case 2:
+            sink += (housetuya_broadcast_parse (buffer, &items) == 0);
+            break;
+        default:
+            sink += buffer[1];
+        }
+    }
+    return (tuyabench_now () - start) / count;
+}
+
+int main (int argc, const char **argv) {
+
+    int count = 1000000;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if ((!strcmp (argv[i], "-n")) && (i + 1 < argc)) {
+            count = atoi (argv[++i]);
+            if (count <= 0) count = 1;
+        } else if (argv[i][0] == '-') {
+            fprintf (stderr, "usage: tuyabench [-n <count>] [<capture>]\n");
+            return 1;
+        } else if (!tuyabench_load (argv[i])) {
+            return 1;
+        }
+    }
+    if (TuyaBenchCount <= 0) {
+        for (i = 0; TuyaBenchSamples[i]; ++i) tuyabench_add (TuyaBenchSamples[i]);
+    }
+
+    // Check that both methods agree on every broadcast first.
+    for (i = 0; i < TuyaBenchCount; ++i) {
+        char scanned[1024];
+        char parsed[1024];
+        TuyaBroadcast fast;
+        TuyaBroadcast slow;
+
+        snprintf (scanned, sizeof(scanned), "%s", TuyaBenchInput[i]);
+        snprintf (parsed, sizeof(parsed), "%s", TuyaBenchInput[i]);
+        int ok = housetuya_broadcast_scan (scanned, &fast);
+        const char *error = housetuya_broadcast_parse (parsed, &slow);
+        if (error) {
+            printf ("** broadcast %d: %s\n", i, error);
+            return 1;
+        }
+        if (!ok) {
+            printf ("** broadcast %d is not handled by the scanner\n", i);
+            return 1;
+        }
+        if (strcmp (fast.id, slow.id) || strcmp (fast.product, slow.product) ||
+            strcmp (fast.version, slow.version) || (fast.encrypt != slow.encrypt)) {
+            printf ("** broadcast %d: the two methods disagree\n", i);
+            return 1;
+        }
+    }
+
+    double copy = tuyabench_run (0, count);
+    double scan = tuyabench_run (1, count) - copy;
+    double parse = tuyabench_run (2, count) - copy;
+
+    printf ("%d broadcasts, %d iterations\n", TuyaBenchCount, count);
+    printf ("scanner: %8.1f ns per broadcast\n", scan);
+    printf ("parser:  %8.1f ns per broadcast\n", parse);
+    if (scan > 0) printf ("speed-up: %.1fx\n", parse / scan);
+    return 0;
+}
@@ -0,0 +1,260 @@
+/* tuyacatalog - Generate the compiled-in catalog of Tuya models
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * tuyacatalog.c - Build the static table of known models at build time.
+ *
+ * SYNOPSYS:
+ *
+ * tuyacatalog <catalog.csv>
+ *
+ *    Read a list of known Tuya models and print a C header that defines
+ *    a static, read-only, table of these models indexed by a perfect hash
+ *    of the product key. This header is included by housetuya_model.c.
+ *
+ *    Each line of the catalog has the format:
+ *
+ *       product key,control data point,name
+ *
+ *    Empty lines and lines starting with '#' are ignored. The name is the
+ *    rest of the line, and may contain commas.
+ *
+ *    The perfect hash uses the "hash and displace" method: the product keys
+ *    are first distributed among buckets using housetuya_hash_nocase().
+ *    Then, starting with the largest bucket, the program searches for a
+ *    seed that makes housetuya_hash_mix() place every key of the bucket
+ *    in a free slot of the table. The lookup is then:
+ *
+ *       unsigned int hash = housetuya_hash_nocase (id);
+ *       unsigned int seed = ModelCatalogSeed[hash % MODEL_CATALOG_BUCKETS];
+ *       int slot = housetuya_hash_mix (hash, seed) % MODEL_CATALOG_SIZE;
+ *
+ *    followed by one strcasecmp() to reject unknown product keys.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "housetuya_hash.h"
+
+#define CATALOG_MAX_SEED 10000000
+
+struct CatalogEntry {
+    char *id;
+    char *name;
+    int control;
+    unsigned int hash;
+};
+
+static struct CatalogEntry *Catalog = 0;
+static int CatalogCount = 0;
+static int CatalogSpace = 0;
+
+static int *BucketSize = 0;
+static int **BucketItems = 0;
+static int BucketCount = 0;
+
+static char *tuyacatalog_trim (char *text) {
+    while (isspace(*text)) text += 1;
+    char *end = text + strlen(text);
+    while ((end > text) && isspace(end[-1])) *(--end) = 0;
+    return text;
+}
+
+static int tuyacatalog_load (const char *filename) {
+
+    char line[1024];
+    int lineno = 0;
+
+    FILE *f = fopen (filename, "r");
+    if (!f) {
+        fprintf (stderr, "tuyacatalog: cannot open %s\n", filename);
+        return 0;
+    }
+    while (fgets (line, sizeof(line), f)) {
+        lineno += 1;
+        char *id = tuyacatalog_trim (line);
+        if ((*id == 0) || (*id == '#')) continue;
+
+        char *control = strchr (id, ',');
+        char *name = control ? strchr (control+1, ',') : 0;
+        if (!name) {
+            fprintf (stderr, "%s:%d: invalid line\n", filename, lineno);
+            fclose (f);
+            return 0;
+        }
+        *(control++) = 0;
+        *(name++) = 0;
+
+        if (CatalogCount >= CatalogSpace) {
+            CatalogSpace += 256;
+            Catalog = realloc (Catalog, CatalogSpace * sizeof(*Catalog));
+            if (!Catalog) {
+                fprintf (stderr, "tuyacatalog: no more memory\n");
+                fclose (f);
+                return 0;
+            }
+        }
+        struct CatalogEntry *entry = Catalog + CatalogCount;
+        entry->id = strdup (tuyacatalog_trim (id));
+        entry->name = strdup (tuyacatalog_trim (name));
+        entry->control = atoi (control);
+        if ((entry->id[0] == 0) || (entry->control <= 0)) {
+            fprintf (stderr, "%s:%d: invalid product key or data point\n",
+                     filename, lineno);
+            fclose (f);
+            return 0;
+        }
+        entry->hash = housetuya_hash_nocase (entry->id);
+        CatalogCount += 1;
+    }
+    fclose (f);
+    return 1;
+}
+
+static int tuyacatalog_compare (const void *a, const void *b) {
+    return BucketSize[*(const int *)b] - BucketSize[*(const int *)a];
+}
+
+// Compute the seed of each bucket. Return the slot assigned to each entry,
+// or 0 on failure.
+//
+static int *tuyacatalog_place (int size, unsigned int *seeds) {
+
+    int i, j, k;
+
+    BucketCount = (CatalogCount + 3) / 4;
+    BucketSize = calloc (BucketCount, sizeof(int));
+    BucketItems = calloc (BucketCount, sizeof(int *));
+    for (i = 0; i < CatalogCount; ++i) {
+        int b = Catalog[i].hash % BucketCount;
+        BucketItems[b] = realloc (BucketItems[b], (BucketSize[b]+1) * sizeof(int));
+        BucketItems[b][BucketSize[b]++] = i;
+    }
+    int *order = calloc (BucketCount, sizeof(int));
+    for (i = 0; i < BucketCount; ++i) order[i] = i;
+    qsort (order, BucketCount, sizeof(int), tuyacatalog_compare);
+
+    int *slots = calloc (CatalogCount, sizeof(int));
+    int *owner = malloc (size * sizeof(int));
+    for (i = 0; i < size; ++i) owner[i] = -1;
+
+    for (i = 0; i < BucketCount; ++i) {
+        int b = order[i];
+        int *items = BucketItems[b];
+        if (BucketSize[b] <= 0) break; // All remaining buckets are empty.
+
+        for (j = 1; j < BucketSize[b]; ++j) {
+            for (k = 0; k < j; ++k) {
+                if (!strcasecmp (Catalog[items[j]].id, Catalog[items[k]].id)) {
+                    fprintf (stderr, "tuyacatalog: duplicate product key %s\n",
+                             Catalog[items[j]].id);
+                    return 0;
+                }
+            }
+        }
+
+        unsigned int seed;
+        for (seed = 0; seed < CATALOG_MAX_SEED; ++seed) {
+            for (j = 0; j < BucketSize[b]; ++j) {
+                int slot = housetuya_hash_mix (Catalog[items[j]].hash, seed) % size;
+                if (owner[slot] >= 0) break;
+                for (k = 0; k < j; ++k) if (slots[items[k]] == slot) break;
+                if (k < j) break;
+                slots[items[j]] = slot;
+            }
+            if (j >= BucketSize[b]) break;
+        }
+        if (seed >= CATALOG_MAX_SEED) {
+            fprintf (stderr, "tuyacatalog: cannot build the perfect hash\n");
+            return 0;
+        }
+        seeds[b] = seed;
+        for (j = 0; j < BucketSize[b]; ++j) owner[slots[items[j]]] = items[j];
+    }
+    free (owner);
+    free (order);
+    return slots;
+}
+
+static void tuyacatalog_string (const char *text) {
+    putchar ('"');
+    for (; *text; ++text) {
+        if ((*text == '"') || (*text == '\\')) putchar ('\\');
+        putchar (*text);
+    }
+    putchar ('"');
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+
+    if (argc != 2) {
+        fprintf (stderr, "usage: tuyacatalog <catalog.csv>\n");
+        return 1;
+    }
+    if (!tuyacatalog_load (argv[1])) return 1;
+
+    // A table slightly larger than the number of keys makes the search
+    // for seeds much faster, for a small cost in memory.
+    //
+    int size = CatalogCount ? CatalogCount + (CatalogCount / 8) + 1 : 0;
+    unsigned int *seeds = calloc (CatalogCount / 4 + 1, sizeof(unsigned int));
+    int *slots = 0;
+    if (CatalogCount > 0) {
+        slots = tuyacatalog_place (size, seeds);
+        if (!slots) return 1;
+    }
+
+    printf ("/* Generated by tuyacatalog from %s. Do not edit. */\n\n", argv[1]);
+    printf ("#define MODEL_CATALOG_SIZE %d\n", size);
+    printf ("#define MODEL_CATALOG_BUCKETS %d\n\n", BucketCount);
+
+    printf ("static const struct ModelCatalogEntry {\n"
+            "    const char *id;\n"
+            "    const char *name;\n"
+            "    int control;\n"
+            "} ModelCatalog[] = {\n");
+    if (size == 0) printf ("    {0, 0, 0}\n"); // No empty array in C.
+    int *entries = malloc ((size + 1) * sizeof(int));
+    for (i = 0; i < size; ++i) entries[i] = -1;
+    for (i = 0; i < CatalogCount; ++i) entries[slots[i]] = i;
+    for (i = 0; i < size; ++i) {
+        if (entries[i] < 0) {
+            printf ("    {0, 0, 0},\n");
+            continue;
+        }
+        struct CatalogEntry *entry = Catalog + entries[i];
+        printf ("    {");
+        tuyacatalog_string (entry->id);
+        printf (", ");
+        tuyacatalog_string (entry->name);
+        printf (", %d},\n", entry->control);
+    }
+    printf ("};\n\n");
+
+    printf ("static const unsigned int ModelCatalogSeed[] = {\n");
+    if (BucketCount == 0) printf ("    0\n");
+    for (i = 0; i < BucketCount; ++i) printf ("    %u,\n", seeds[i]);
+    printf ("};\n\n");
+    return 0;
+}
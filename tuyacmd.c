@@ -120,57 +120,105 @@ static int tuyacmd_wait(int s) {
     return select (s+1, &receive, 0, 0, &timeout);
 }
 
-static void tuyacmd_receive (int s, const TuyaSecret *secret, int expected) {
+static int tuyacmd_receive (int s, TuyaSecret *secret, int expected,
+                            char *buffer, int buffersize) {
+
+    char coded[4096];
+    int received = 0;
 
     for (;;) {
         if (tuyacmd_wait(s) <= 0) {
             printf ("** No response.\n");
-            return;
+            return 0;
         }
-        char buffer[1024];
-        char coded[1024];
         int code;
         int sequence;
-        int size = read (s, coded, sizeof(coded));
+        int size = read (s, coded+received, sizeof(coded)-received);
         if (size <= 0) {
             printf ("** Empty response.\n");
-            return;
+            return 0;
         }
-        size = housetuya_extract (buffer, sizeof(buffer), secret, &code, &sequence, coded, size);
-        if (size <= 0) continue;
-        buffer[size] = 0;
-        printf ("Response: %s\n", buffer);
-        if (code == expected) {
-            DEBUG ("Expected code %d received\n", code);
-            return;
+        received += size;
+
+        // There might be multiple messages, or only a portion of one.
+        int cursor = 0;
+        while (cursor < received) {
+            int length = housetuya_frame (coded+cursor, received-cursor);
+            if (length == 0) break;
+            if (length < 0) {
+                cursor -= length;
+                continue;
+            }
+            size = housetuya_extract (buffer, buffersize, secret,
+                                      &code, &sequence, coded+cursor, length);
+            cursor += length;
+            if (size <= 0) continue;
+            if (code == TUYA_SESS_KEY_NEG_RESP) {
+                DEBUG ("Session negotiation response received\n");
+            } else {
+                buffer[size] = 0;
+                printf ("Response: %s\n", buffer);
+            }
+            if ((code == expected) ||
+                ((expected == TUYA_QUERY) && (code == TUYA_QUERY_NEW))) {
+                DEBUG ("Expected code %d received\n", code);
+                return size;
+            }
         }
+        received -= cursor;
+        if (received >= sizeof(coded)) received = 0; // Cannot fit: give up.
+        if (received > 0) memmove (coded, coded+cursor, received);
     }
 }
 
-static void tuyacmd_command (int s, const TuyaSecret *secret, int dps, int value) {
-    char command[1024];
-    int length =
-        housetuya_control (command, sizeof(command), secret, 0, dps, value);
-
+static void tuyacmd_send (int s, const char *command, int length) {
     int sent = write (s, command, length);
     if (sent < 0) {
         printf ("** send() error: %s\n", strerror(errno));
         exit(1);
     }
-    tuyacmd_receive (s, secret, TUYA_STATUS);
 }
 
-static void tuyacmd_refresh (int s, const TuyaSecret *secret) {
+static void tuyacmd_negotiate (int s, TuyaSecret *secret) {
     char command[1024];
-    int length = housetuya_query (command, sizeof(command), secret, 0);
+    char response[4096];
 
-    int sent = write (s, command, length);
-    if (sent < 0) {
-        printf ("** send() error: %s\n", strerror(errno));
+    if (housetuya_session_ready (secret)) return; // Not needed.
+
+    int length = housetuya_session_start (command, sizeof(command), secret, 0);
+    tuyacmd_send (s, command, length);
+
+    length = tuyacmd_receive (s, secret, TUYA_SESS_KEY_NEG_RESP,
+                              response, sizeof(response));
+    if (length <= 0) exit(1);
+    length = housetuya_session_finish (command, sizeof(command), secret, 0,
+                                       response, length);
+    if (length <= 0) {
+        printf ("** session negotiation failed\n");
         exit(1);
     }
+    tuyacmd_send (s, command, length);
+}
+
+static void tuyacmd_command (int s, TuyaSecret *secret, int dps, int value) {
+    char command[1024];
+    char response[4096];
 
-    tuyacmd_receive (s, secret, TUYA_QUERY);
+    tuyacmd_negotiate (s, secret);
+    int length =
+        housetuya_control (command, sizeof(command), secret, 0, dps, value);
+    tuyacmd_send (s, command, length);
+    tuyacmd_receive (s, secret, TUYA_STATUS, response, sizeof(response));
+}
+
+static void tuyacmd_refresh (int s, TuyaSecret *secret) {
+    char command[1024];
+    char response[4096];
+
+    tuyacmd_negotiate (s, secret);
+    int length = housetuya_query (command, sizeof(command), secret, 0);
+    tuyacmd_send (s, command, length);
+    tuyacmd_receive (s, secret, TUYA_QUERY, response, sizeof(response));
 }
 
 
@@ -216,8 +264,10 @@ static int tuyacmd_discovery (time_t wait) {
     int addrlen = sizeof(addr);
 
     static TuyaSecret DiscoverySecret = {0};
-    if (!DiscoverySecret.key)
-        DiscoverySecret.key = strdup(housetuya_discoverykey());
+    if (!DiscoverySecret.key) {
+        DiscoverySecret.key = (char *)housetuya_discoverykey();
+        DiscoverySecret.cipher = housetuya_discoverycipher();
+    }
 
     fd_set receive;
     struct timeval timeout;
@@ -266,7 +316,7 @@ static int tuyacmd_discovery (time_t wait) {
 
 int main (int argc, char **argv) {
 
-    TuyaSecret secret;
+    TuyaSecret secret = {0};
 
     const char *host = 0;
     const char *id = 0;
@@ -0,0 +1,231 @@
+/* tuyatest - Regression tests for the HouseTuya service
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * tuyatest.c - Regression tests that do not require any Tuya device.
+ *
+ * SYNOPSYS:
+ *
+ * tuyatest
+ *
+ *    Run every test, print a line for each failure, and exit with a
+ *    non-zero status if any test failed. The configuration is loaded
+ *    from, and saved to, a temporary file.
+ */
+
+#include <unistd.h>
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "houseconfig.h"
+
+#include "housetuya_json.h"
+#include "housetuya_messages.h"
+#include "housetuya_device.h"
+#include "housetuya_broadcast.h"
+
+#define TUYATEST_CONFIG "/tmp/tuyatest.json"
+
+static const char TuyaTestConfig[] =
+    "{\"tuya\":{\"devices\":["
+    "{\"name\":\"%s\",\"id\":\"eb1234567890abcdefgh\","
+    "\"model\":\"keyabcdefgh12345\",\"key\":\"0123456789abcdef\"}]}}";
+
+static int TuyaTestFailures = 0;
+
+int housetuya_isdebug (void) {
+    return 0;
+}
+
+static void tuyatest_fail (const char *test, const char *reason) {
+    printf ("** %s: %s\n", test, reason);
+    TuyaTestFailures += 1;
+}
+
+static const char *tuyatest_configure (const char *name) {
+    static char text[512];
+    snprintf (text, sizeof(text), TuyaTestConfig, name);
+    return text;
+}
+
+// The ETag of /tuya/status is built from the status generation: renaming
+// a device must change the generation, and mark that device as updated,
+// or else clients keep showing the old name.
+//
+static void tuyatest_rename (void) {
+
+    static const char *test = "rename";
+
+    const char *error = houseconfig_update (tuyatest_configure ("porch"));
+    if (error) {
+        tuyatest_fail (test, error);
+        return;
+    }
+    housetuya_device_refresh ();
+    int device = housetuya_device_search ("porch");
+    if (device < 0) {
+        tuyatest_fail (test, "device porch not loaded");
+        return;
+    }
+    long long generation = housetuya_device_generation ();
+    long long updated = housetuya_device_updated (device);
+
+    houseconfig_update (tuyatest_configure ("garden"));
+    housetuya_device_refresh ();
+
+    if (housetuya_device_search ("garden") != device)
+        tuyatest_fail (test, "device garden not found");
+    if (housetuya_device_search ("porch") >= 0)
+        tuyatest_fail (test, "device porch still found");
+    if (housetuya_device_generation () == generation)
+        tuyatest_fail (test, "the status generation (ETag) did not change");
+    if (housetuya_device_updated (device) == updated)
+        tuyatest_fail (test, "the device status was not updated");
+
+    // Reloading the same configuration must not change the status.
+    generation = housetuya_device_generation ();
+    houseconfig_update (tuyatest_configure ("garden"));
+    housetuya_device_refresh ();
+    if (housetuya_device_generation () != generation)
+        tuyatest_fail (test, "unchanged configuration changed the generation");
+}
+
+// Several devices may have the same name, to be controlled together:
+// the search must find every one of them.
+//
+static void tuyatest_same_name (void) {
+
+    static const char *test = "same name";
+    static const char config[] =
+        "{\"tuya\":{\"devices\":["
+        "{\"name\":\"fence\",\"id\":\"eb1234567890abcdefgh\","
+        "\"model\":\"keyabcdefgh12345\",\"key\":\"0123456789abcdef\"},"
+        "{\"name\":\"pool\",\"id\":\"bf0987654321zyxwvuts\","
+        "\"model\":\"keyabcdefgh12345\",\"key\":\"0123456789abcdef\"},"
+        "{\"name\":\"fence\",\"id\":\"01200885ecfabc123456\","
+        "\"model\":\"keyabcdefgh12345\",\"key\":\"0123456789abcdef\"}]}}";
+
+    const char *error = houseconfig_update (config);
+    if (error) {
+        tuyatest_fail (test, error);
+        return;
+    }
+    housetuya_device_refresh ();
+
+    int found = 0;
+    int i;
+    for (i = housetuya_device_search ("fence");
+         i >= 0; i = housetuya_device_search_next ("fence", i)) {
+        if (strcmp (housetuya_device_name (i), "fence"))
+            tuyatest_fail (test, "found a device with another name");
+        if (++found > 2) break;
+    }
+    if (found != 2) tuyatest_fail (test, "did not find exactly 2 devices");
+}
+
+// The broadcast scanner must reject anything it does not fully decode,
+// so that the generic JSON parser is used instead.
+//
+static void tuyatest_broadcast_scan (void) {
+
+    static const char *test = "broadcast scan";
+    static const struct {
+        const char *text;
+        int expected;
+    } cases[] = {
+        {"{\"gwId\":\"a\",\"productKey\":\"b\",\"version\":\"3.3\","
+         "\"encrypt\":true}", 1},
+        {"{\"gwId\":\"a\"\"productKey\":\"b\",\"version\":\"3.3\"}", 0},
+        {"{\"gwId\":\"a\",\"productKey\":\"b\",\"version\":\"3.3\","
+         "\"active\":2\"encrypt\":true}", 0},
+        {"{\"gwId\":\"a\\\"b\",\"productKey\":\"b\",\"version\":\"3.3\"}", 0},
+        {"{\"gw\\u0049d\":\"a\",\"productKey\":\"b\",\"version\":\"3.3\"}", 0},
+        {0, 0}
+    };
+    int i;
+    for (i = 0; cases[i].text; ++i) {
+        char input[256];
+        TuyaBroadcast items;
+        snprintf (input, sizeof(input), "%s", cases[i].text);
+        if (housetuya_broadcast_scan (input, &items) != cases[i].expected) {
+            char reason[300];
+            snprintf (reason, sizeof(reason), "wrong result for %s", cases[i].text);
+            tuyatest_fail (test, reason);
+        }
+    }
+}
+
+// Real data point values must be reported at full precision, using no
+// more digits than necessary.
+//
+static void tuyatest_real (void) {
+
+    static const char *test = "real";
+    static TuyaJson json;
+
+    housetuya_json_reset (&json);
+    housetuya_json_object (&json, 0);
+    housetuya_json_real (&json, "a", 0.1);
+    housetuya_json_real (&json, "b", 230.45);
+    housetuya_json_real (&json, "c", 1.0 / 3.0);
+    housetuya_json_end (&json);
+
+    const char *text = housetuya_json_text (&json);
+    if (!text) {
+        tuyatest_fail (test, "no JSON text");
+    } else if (strcmp (text, "{\"a\":0.1,\"b\":230.45,"
+                             "\"c\":0.3333333333333333}")) {
+        char reason[300];
+        snprintf (reason, sizeof(reason), "wrong JSON text %s", text);
+        tuyatest_fail (test, reason);
+    }
+    housetuya_json_free (&json);
+}
+
+int main (int argc, const char **argv) {
+
+    const char *args[] = {"tuyatest", "--config=" TUYATEST_CONFIG, 0};
+
+    FILE *f = fopen (TUYATEST_CONFIG, "w");
+    if (!f) {
+        printf ("** cannot create %s\n", TUYATEST_CONFIG);
+        return 1;
+    }
+    fputs ("{\"tuya\":{\"devices\":[]}}", f);
+    fclose (f);
+
+    const char *error = houseconfig_load (2, args);
+    if (error) {
+        printf ("** cannot load %s: %s\n", TUYATEST_CONFIG, error);
+        return 1;
+    }
+    tuyatest_rename ();
+    tuyatest_same_name ();
+    tuyatest_broadcast_scan ();
+    tuyatest_real ();
+
+    unlink (TUYATEST_CONFIG);
+    if (TuyaTestFailures) return 1;
+    printf ("all tests passed\n");
+    return 0;
+}